@@ -0,0 +1,14 @@
+# 100,000 iterations using only built-ins: five nested 10-value loops
+# exercising for, if, &&, ||, assignment and $VAR expansion.
+for a in 0 1 2 3 4 5 6 7 8 9; do
+    for b in 0 1 2 3 4 5 6 7 8 9; do
+        for c in 0 1 2 3 4 5 6 7 8 9; do
+            for d in 0 1 2 3 4 5 6 7 8 9; do
+                for e in 0 1 2 3 4 5 6 7 8 9; do
+                    if true; then n=$a$b$c$d$e; else false; fi
+                    false || true && last=$n
+                done
+            done
+        done
+    done
+done
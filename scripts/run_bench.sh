@@ -0,0 +1,86 @@
+#!/bin/bash
+
+# cmpsh Benchmark Runner
+# Reports startup time, then times every script in bench/ with cmpsh
+# (and /bin/sh for reference)
+
+set -e  # Exit on any error
+
+# Colors for output
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Benchmark configuration
+SHELL_BINARY="../build/cmpsh"
+BENCH_DIR="../bench"
+RUNS=${RUNS:-5}
+
+# Print the best wall-clock time in milliseconds over $RUNS runs
+best_time_ms() {
+    local best=""
+    for ((i = 0; i < RUNS; i++)); do
+        local start end elapsed
+        start=$(date +%s%N)
+        "$@" > /dev/null 2>&1
+        end=$(date +%s%N)
+        elapsed=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+    done
+    echo "$best"
+}
+
+# Time one script with cmpsh, and with /bin/sh for reference
+time_script() {
+    local name=$1
+    local script=$2
+    echo -e "${GREEN}✓${NC} $name: cmpsh $(best_time_ms "$SHELL_BINARY" --norc "$script") ms"
+    if [ -x /bin/sh ]; then
+        echo "  $name: /bin/sh $(best_time_ms /bin/sh "$script") ms"
+    fi
+}
+
+main() {
+    echo "==============================================="
+    echo "           cmpsh Benchmarks"
+    echo "==============================================="
+    echo
+
+    if [ ! -x "$SHELL_BINARY" ]; then
+        echo "Shell binary $SHELL_BINARY not found or not executable"
+        echo "Please run 'make' first to build the shell"
+        exit 1
+    fi
+
+    # Startup with bench/startup.cmpshrc: first run compiles the snapshot
+    local rc_home
+    rc_home=$(mktemp -d)
+    cp "$BENCH_DIR/startup.cmpshrc" "$rc_home/.cmpshrc"
+    echo -e "${BLUE}ℹ INFO${NC}: startup (cold: rc script, warm: snapshot)"
+    echo "  cold: $(HOME=$rc_home "$SHELL_BINARY" --startup-stats /dev/null 2>&1 | head -1)"
+    echo "  warm: $(HOME=$rc_home "$SHELL_BINARY" --startup-stats /dev/null 2>&1 | head -1)"
+    rm -rf "$rc_home"
+
+    echo -e "${BLUE}ℹ INFO${NC}: best of $RUNS runs"
+    for script in "$BENCH_DIR"/*.sh; do
+        time_script "$(basename "$script" .sh)" "$script"
+    done
+
+    # One 20,000-line if block, generated: the whole construct must be read
+    # before it runs, so this times how input lines are accumulated and parsed
+    local long_block
+    long_block=$(mktemp)
+    {
+        echo "if true; then"
+        for ((i = 0; i < 20000; i++)); do
+            echo "    x=1"
+        done
+        echo "fi"
+    } > "$long_block"
+    time_script long_block "$long_block"
+    rm -f "$long_block"
+}
+
+main
@@ -57,8 +57,8 @@ run_test() {
     # Copy shell binary to temp directory
     cp "../$SHELL_BINARY" .
     
-    # Run the test
-    if timeout 10s ./cmpsh "../$TEST_DIR/$test_script" > output.txt 2> error.txt; then
+    # Run the test (HOME is the temp dir so no real ~/.cmpshrc is read or snapshotted)
+    if HOME="$PWD" timeout 10s ./cmpsh "../$TEST_DIR/$test_script" > output.txt 2> error.txt; then
         local actual_exit_code=$?
     else
         local actual_exit_code=$?
@@ -97,8 +97,8 @@ test_interactive() {
     cd "$TEMP_DIR"
     cp "../$SHELL_BINARY" .
     
-    # Run interactive test
-    echo -e "$commands" | timeout 5s ./cmpsh > output.txt 2> error.txt || true
+    # Run interactive test (-i: stdin is a pipe, not a terminal)
+    echo -e "$commands" | HOME="$PWD" timeout 5s ./cmpsh -i > output.txt 2> error.txt || true
     
     if grep -q "$expected_output" output.txt; then
         print_status "PASS" "$test_name"
@@ -115,6 +115,40 @@ test_interactive() {
     rm -rf "$TEMP_DIR"
 }
 
+# Function to test ~/.cmpshrc loading and its snapshot
+test_startup_snapshot() {
+    local test_name=$1
+
+    TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+    print_status "INFO" "Running startup test: $test_name"
+
+    mkdir -p "$TEMP_DIR"
+    cd "$TEMP_DIR"
+    cp "../$SHELL_BINARY" .
+    printf 'path /bin /usr/bin\nalias say echo\ngreeting=hello\n' > .cmpshrc
+
+    # First run compiles the rc into a snapshot, second run loads it
+    echo 'say $greeting' | HOME=. ./cmpsh --startup-stats > cold.txt 2>&1 || true
+    echo 'say $greeting' | HOME=. ./cmpsh --startup-stats > warm.txt 2>&1 || true
+
+    if grep -q "(script)" cold.txt && grep -q "(snapshot)" warm.txt &&
+       grep -q "hello" warm.txt && [ -f .cmpshrc.snap ]; then
+        print_status "PASS" "$test_name"
+        PASSED_TESTS=$((PASSED_TESTS + 1))
+    else
+        print_status "FAIL" "$test_name"
+        FAILED_TESTS=$((FAILED_TESTS + 1))
+        echo "Cold start output:"
+        cat cold.txt
+        echo "Warm start output:"
+        cat warm.txt
+    fi
+
+    cd ..
+    rm -rf "$TEMP_DIR"
+}
+
 # Main test execution
 main() {
     echo "==============================================="
@@ -209,12 +243,27 @@ invalid-command-name
 exit
 EOF
     run_test "Error Handling" "error_test.sh" 0  # Shell should continue after errors
+
+    # Test 7: Control flow (;, &&, ||, if, while, until, for, $?)
+    run_test "Control Flow" "control_flow.sh"
+
+    # Test 8: Runtime metrics (stats, stats prometheus)
+    run_test "Runtime Metrics" "stats.sh"
+
+    # Test 9: CPU pinning, niceness and resource limits
+    run_test "Process Limits" "limits.sh"
+
+    # Test 10: Batch mode (-c, -s, piped stdin without prompts)
+    run_test "Batch Mode" "batch.sh"
     
     # Interactive tests
     print_status "INFO" "Running interactive mode tests..."
     
     test_interactive "Interactive Prompt" "pwd\nexit\n" "cmpsh>"
     test_interactive "Exit Command" "exit\n" ""
+
+    # Startup file tests
+    test_startup_snapshot "Startup Snapshot"
     
     # Summary
     echo
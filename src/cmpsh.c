@@ -2,13 +2,21 @@
  * cmpsh - Custom Shell Implementation
  * 
  * A Unix-compatible shell written in C that provides:
- * - Interactive and non-interactive modes
- * - Built-in commands (exit, cd, pwd, path)
+ * - Interactive and non-interactive modes (script file, -c, piped stdin)
+ * - Built-in commands (exit, cd, pwd, path, true, false)
  * - External command execution with path resolution
  * - Piping support for command chaining
  * - I/O redirection to files
+ * - Control flow (;, &&, ||, if, while, until, for) and $? status
+ * - $PATH import, ~/.cmpshrc startup file and its binary snapshot
+ * - Runtime metrics (stats built-in, Prometheus text export)
+ * - CPU pinning, niceness and resource limits for launched commands
  * - Proper signal handling (SIGINT, SIGTSTP)
  * - Memory management and error handling
+ *
+ * Input is lexed and parsed into an abstract syntax tree once per
+ * complete command, then interpreted; loop bodies are re-executed
+ * from the tree without being tokenized again.
  * 
  * Author: Your Name
  * Date: September 2025
@@ -16,6 +24,7 @@
 
 #define _POSIX_C_SOURCE 200809L  /* Enable POSIX functions */
 #define _DEFAULT_SOURCE          /* Enable additional functions like strdup */
+#define _GNU_SOURCE              /* Enable sched_setaffinity and cpu_set_t */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,18 +32,51 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 /* Configuration constants */
 #define MAX_LINE 1024        /* Maximum input line length */
-#define MAX_TOKENS 10        /* Maximum tokens per command */
 #define MAX_PATHS 10         /* Maximum search paths */
 #define MAX_COMMANDS 10      /* Maximum commands in pipeline */
 #define MAX_HISTORY 100      /* Maximum history entries */
 #define MAX_ALIASES 50       /* Maximum number of aliases */
+#define VARIABLE_HASH_SIZE 64 /* Buckets in the shell variable table */
+#define MAX_RC_ENV_DEPS 100  /* Environment variables tracked for a snapshot */
+#define COMMAND_HASH_SIZE 64 /* Buckets in the command lookup cache */
+#define MAX_CPUS 1024        /* CPUs addressable by pin */
+#define INPUT_BUFFER_SIZE 65536 /* stdio buffer for non-interactive input */
+#define DEFAULT_NICE 10      /* Adjustment for nice without a number */
+
+/* Startup file and its compiled snapshot (both under $HOME) */
+#define RC_FILE ".cmpshrc"
+#define SNAPSHOT_SUFFIX ".snap"
+#define SNAPSHOT_MAGIC "CMPSNAP1"
+
+/* Metrics */
+#define MAX_BUCKETS 16       /* Maximum finite buckets per histogram */
+#define METRICS_TEXT_SIZE 8192 /* Buffer for Prometheus text output */
+
+/* Children share one counter block and must add atomically; the shell
+ * process owns its block and uses plain adds on the dispatch path. */
+#define METRIC_ADD(field, n) do { \
+        if (metrics_atomic) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED); \
+        else (field) += (n); \
+    } while (0)
+
+/* Exit statuses reported through $? */
+#define STATUS_SYNTAX_ERROR 2    /* Input could not be parsed */
+#define STATUS_EXEC_FAILED 126   /* Command found but could not be executed */
+#define STATUS_NOT_FOUND 127     /* Command not found in search paths */
 
 /* Alias structure */
 typedef struct {
@@ -42,6 +84,163 @@ typedef struct {
     char* command;           /* Command to execute */
 } alias_t;
 
+/* Shell variable, chained in a variable table bucket */
+typedef struct variable {
+    char* name;              /* Variable name */
+    char* value;             /* Variable value */
+    struct variable* next;   /* Next variable in the bucket */
+} variable_t;
+
+/* Cached command lookup: name -> resolved executable path */
+typedef struct command_hash_entry {
+    char* name;              /* Command name */
+    char* path;              /* Resolved executable path */
+    struct command_hash_entry* next; /* Next entry in the bucket */
+} command_hash_entry_t;
+
+/* Snapshot file header, followed by NUL-terminated strings */
+typedef struct {
+    char magic[8];           /* SNAPSHOT_MAGIC */
+    long long rc_mtime_sec;  /* Modification time of the rc file */
+    long long rc_mtime_nsec;
+    long long rc_size;       /* Size of the rc file */
+    unsigned int num_deps;   /* Environment variables the rc read */
+    unsigned int num_paths;  /* Search paths */
+    unsigned int num_aliases; /* Aliases (name, command) */
+    unsigned int num_variables; /* Shell variables (name, value) */
+    unsigned int num_hashed; /* Command hash entries (name, path) */
+} snapshot_header_t;
+
+/* Timings collected for --startup-stats */
+typedef struct {
+    long path_import_us;     /* Time to import $PATH */
+    int imported_paths;      /* Search paths taken from $PATH */
+    long rc_load_us;         /* Time to load the rc file or snapshot */
+    long total_us;           /* Time from main() to the first prompt */
+    const char* rc_source;   /* "none", "disabled", "snapshot" or "script" */
+} startup_stats_t;
+
+/* Histogram with cumulative export; buckets[num_bounds] is +Inf */
+typedef struct {
+    unsigned long long buckets[MAX_BUCKETS + 1]; /* Per-bucket counts */
+    unsigned long long count;  /* Number of observations */
+    unsigned long long sum;    /* Sum of observations */
+} histogram_t;
+
+/* Runtime counters (unsigned long long fields only, summed as an array) */
+typedef struct {
+    unsigned long long commands;      /* Simple commands executed */
+    unsigned long long builtins;      /* Built-ins run */
+    unsigned long long forks;         /* Successful fork() calls */
+    unsigned long long fork_failures; /* Failed fork() calls */
+    unsigned long long exec_failures; /* Failed execv() calls */
+    unsigned long long not_found;     /* Command not found errors */
+    unsigned long long path_hits;     /* Path lookups answered by the cache */
+    unsigned long long path_misses;   /* Path lookups that scanned the paths */
+    histogram_t fork_exec_us;         /* fork() to execv() latency */
+    histogram_t wait_us;              /* Time spent waiting for a pipeline */
+    histogram_t pipeline_depth;       /* Stages per launched pipeline */
+} metrics_t;
+
+/* Lexical token types */
+typedef enum {
+    TOK_WORD,                /* Command name, argument or keyword */
+    TOK_PIPE,                /* | */
+    TOK_AND,                 /* && */
+    TOK_OR,                  /* || */
+    TOK_SEMI,                /* ; */
+    TOK_NEWLINE,             /* End of an input line */
+    TOK_REDIRECT,            /* > */
+    TOK_END                  /* End of input */
+} token_type_t;
+
+/* Lexical token */
+typedef struct {
+    token_type_t type;       /* Token type */
+    char* text;              /* Word with quotes removed (TOK_WORD only) */
+    int quoted;              /* Nonzero if any part of the word was quoted */
+    int literal;             /* Nonzero if the word was entirely single-quoted */
+    int assignment;          /* Nonzero if the word starts with unquoted NAME= */
+    int from_alias;          /* Nonzero if spliced in from an alias value */
+} token_t;
+
+/* Growable token array produced by the lexer */
+typedef struct {
+    token_t* tokens;         /* Token storage */
+    int count;               /* Number of tokens */
+    int capacity;            /* Allocated token slots */
+} token_list_t;
+
+/* Parser results */
+typedef enum {
+    PARSE_OK,                /* A complete program was parsed */
+    PARSE_INCOMPLETE,        /* Input ended inside a construct; read more */
+    PARSE_ERROR              /* Syntax error (already reported) */
+} parse_status_t;
+
+/* Abstract syntax tree node types */
+typedef enum {
+    NODE_COMMAND,            /* Simple command with optional > redirection */
+    NODE_PIPELINE,           /* Two or more commands joined by | */
+    NODE_AND,                /* cond && body */
+    NODE_OR,                 /* cond || body */
+    NODE_LIST,               /* Commands separated by ; or newlines */
+    NODE_IF,                 /* if cond; then body; else else_body; fi */
+    NODE_WHILE,              /* while/until cond; do body; done */
+    NODE_FOR                 /* for name in words; do body; done */
+} node_type_t;
+
+/* Word stored in the syntax tree, expanded each time it is executed */
+typedef struct {
+    char* text;              /* Word text with quotes removed */
+    int literal;             /* Nonzero to skip variable expansion */
+} word_t;
+
+/* Abstract syntax tree node */
+typedef struct node {
+    node_type_t type;        /* Node type */
+    word_t* words;           /* Command words or for-loop values */
+    int num_words;           /* Number of words */
+    int num_assignments;     /* Leading NAME=value words (commands only) */
+    word_t* redirect;        /* Output redirection target, or NULL */
+    struct node** children;  /* Pipeline stages or list entries */
+    int num_children;        /* Number of children */
+    struct node* cond;       /* Condition, or left operand of && and || */
+    struct node* body;       /* Body, or right operand of && and || */
+    struct node* else_body;  /* else/elif branch of an if */
+    char* name;              /* Loop variable of a for */
+    int negate;              /* Nonzero for until loops */
+} node_t;
+
+/* Set of CPUs parsed from a list such as 0-3,8 */
+typedef struct {
+    unsigned char bits[MAX_CPUS / 8]; /* One bit per CPU */
+    int count;               /* Number of CPUs in the set */
+} cpu_list_t;
+
+/* Pipeline stage prepared for launching */
+typedef struct {
+    node_t* node;            /* Stage syntax tree */
+    char** argv;             /* Expanded words (simple commands only) */
+    int argc;                /* Number of expanded words */
+    int command;             /* Index of the command word, after assignments, prefixes and empty words */
+    char* redirect;          /* Expanded output file, or NULL */
+    int external;            /* Nonzero if argv names an external program */
+    int pinned;              /* Nonzero if a pin prefix set cpus */
+    cpu_list_t cpus;         /* CPUs the stage may run on */
+    int niced;               /* Nonzero if a nice prefix set nice_adjust */
+    int nice_adjust;         /* Niceness added by the nice prefix */
+    char full_path[MAX_LINE]; /* Resolved executable path */
+} stage_t;
+
+/* Resource limit that ulimit sets for launched commands */
+typedef struct {
+    char option;             /* ulimit flag letter */
+    int resource;            /* RLIMIT_* constant */
+    rlim_t unit;             /* Bytes per unit shown to the user */
+    const char* description; /* Label for ulimit -a */
+} limit_option_t;
+
 /* Global variables */
 char** paths = NULL;         /* Array of executable search paths */
 int num_paths = 0;          /* Number of configured paths */
@@ -50,16 +249,65 @@ char** command_history = NULL; /* Command history array */
 int history_count = 0;      /* Number of commands in history */
 alias_t aliases[MAX_ALIASES]; /* Command aliases */
 int alias_count = 0;        /* Number of defined aliases */
+variable_t* variables[VARIABLE_HASH_SIZE]; /* Shell variables by name hash */
+int variable_count = 0;     /* Number of defined variables */
+int last_status = 0;        /* Exit status of the last command ($?) */
+volatile sig_atomic_t interrupted = 0; /* Set by SIGINT to stop loops */
+FILE* input_stream = NULL;  /* Script file or stdin */
+token_list_t input_tokens;  /* Tokens read for the command being parsed */
+node_t* current_program = NULL; /* Syntax tree currently executing */
+int in_child = 0;           /* Nonzero in a forked pipeline stage */
+command_hash_entry_t* command_hash[COMMAND_HASH_SIZE]; /* Command lookup cache */
+int hashed_count = 0;       /* Number of cached command lookups */
+int sourcing_rc = 0;        /* Nonzero while running the rc file */
+int rc_side_effects = 0;    /* Set if the rc did more than define state */
+char* rc_env_deps[MAX_RC_ENV_DEPS]; /* Environment variables read by the rc */
+int rc_env_dep_count = 0;   /* Number of recorded dependencies */
+metrics_t shell_metrics;    /* Counters updated by the shell process */
+metrics_t* child_metrics = NULL; /* Shared counters updated by children */
+metrics_t* metrics = &shell_metrics; /* Counters this process updates */
+int metrics_atomic = 0;     /* Nonzero when metrics is child_metrics */
+char* metrics_file = NULL;  /* Prometheus text file, or NULL */
+unsigned int metrics_interval = 0; /* Seconds between exports, 0 for none */
+cpu_list_t pipeline_cpus;   /* CPUs pipeline stages are spread across */
+
+/* Limits accepted by ulimit; the first is the default */
+const limit_option_t limit_options[] = {
+    {'f', RLIMIT_FSIZE, 1024, "file size (kbytes)"},
+    {'c', RLIMIT_CORE, 1024, "core file size (kbytes)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+};
+#define NUM_LIMIT_OPTIONS (int)(sizeof(limit_options) / sizeof(limit_options[0]))
+struct rlimit child_limits[NUM_LIMIT_OPTIONS]; /* Limits set by ulimit */
+int child_limit_set[NUM_LIMIT_OPTIONS]; /* Nonzero if child_limits[i] applies */
+
+/* Histogram bucket upper bounds */
+const unsigned long long latency_bounds_us[] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 100000, 1000000
+};
+const unsigned long long depth_bounds[] = {1, 2, 3, 4, 5, 6, 8, 10};
+#define NUM_LATENCY_BOUNDS (int)(sizeof(latency_bounds_us) / sizeof(latency_bounds_us[0]))
+#define NUM_DEPTH_BOUNDS (int)(sizeof(depth_bounds) / sizeof(depth_bounds[0]))
+
+int execute_node(node_t* node);
+void shell_exit(int status);
+void write_metrics_file(void);
 
 /**
  * Signal handler for SIGINT (Ctrl+C)
  * Forwards the signal to the currently running child process
- * while keeping the shell alive.
+ * while keeping the shell alive, and stops any running loop.
  * 
  * @param sig Signal number (unused)
  */
 void sigint_handler(int sig) {
     (void)sig; /* Suppress unused parameter warning */
+    interrupted = 1;
     if (current_child != -1) {
         kill(current_child, SIGINT);
     }
@@ -128,44 +376,315 @@ void show_history(void) {
 }
 
 /**
- * Simple environment variable expansion.
- * Expands $HOME, $USER, and $PWD in command arguments.
+ * Append bytes to a growable, null-terminated string buffer.
  * 
- * @param arg Argument string that may contain environment variables
- * @return Expanded string (caller must free) or original string if no expansion
+ * @param buf Buffer pointer (may be NULL initially)
+ * @param len Current string length, updated on success
+ * @param cap Current allocation size, updated on growth
+ * @param text Bytes to append
+ * @param n Number of bytes to append
+ * @return 0 on success, -1 on allocation failure
  */
-char* expand_variables(const char* arg) {
-    if (!arg || strlen(arg) == 0) return strdup("");
+int append_text(char** buf, size_t* len, size_t* cap, const char* text, size_t n) {
+    if (*len + n + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 64;
+        while (*len + n + 1 > new_cap) {
+            new_cap *= 2;
+        }
+        char* grown = realloc(*buf, new_cap);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, text, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
     
-    /* Simple expansion for common variables */
-    if (strcmp(arg, "$HOME") == 0) {
-        char* home = getenv("HOME");
-        return home ? strdup(home) : strdup("");
-    } else if (strcmp(arg, "$USER") == 0) {
-        char* user = getenv("USER");
-        return user ? strdup(user) : strdup("");
-    } else if (strcmp(arg, "$PWD") == 0) {
-        char cwd[MAX_LINE];
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            return strdup(cwd);
+/**
+ * Check whether a string is a valid variable name
+ * (a letter or underscore followed by letters, digits or underscores).
+ *
+ * @param name Candidate name
+ * @param len Number of characters to check
+ * @return 1 if valid, 0 otherwise
+ */
+int is_valid_name(const char* name, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) {
+            return 0;
         }
-        return strdup("");
     }
+    return 1;
+}
     
+/**
+ * Hash a name for the variable table and command cache (djb2).
+ *
+ * @param name Name to hash
+ * @return Hash value, reduced modulo the table size by the caller
+ */
+unsigned int hash_name(const char* name) {
+    unsigned int hash = 5381;
+    while (*name) {
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash;
+}
+
+/**
+ * Set or update a shell variable.
+ *
+ * @param name Variable name
+ * @param value Variable value
+ * @return 0 on success, -1 on error
+ */
+int set_variable(const char* name, const char* value) {
+    if (!name || !value) return -1;
+
+    unsigned int bucket = hash_name(name) % VARIABLE_HASH_SIZE;
+    variable_t* var = variables[bucket];
+    while (var && strcmp(var->name, name) != 0) {
+        var = var->next;
+    }
+    char* value_copy = strdup(value);
+    if (!value_copy) return -1;
+
+    /* Update existing variable */
+    if (var) {
+        free(var->value);
+        var->value = value_copy;
+        return 0;
+    }
+
+    var = malloc(sizeof(variable_t));
+    if (!var || !(var->name = strdup(name))) {
+        free(var);
+        free(value_copy);
+        return -1;
+    }
+    var->value = value_copy;
+    var->next = variables[bucket];
+    variables[bucket] = var;
+    variable_count++;
+    return 0;
+}
+
+/**
+ * Free all shell variables.
+ */
+void clear_variables(void) {
+    for (int i = 0; i < VARIABLE_HASH_SIZE; i++) {
+        variable_t* var = variables[i];
+        while (var) {
+            variable_t* next = var->next;
+            free(var->name);
+            free(var->value);
+            free(var);
+            var = next;
+        }
+        variables[i] = NULL;
+    }
+    variable_count = 0;
+}
+
+/**
+ * Note that the rc file did something a snapshot cannot replay
+ * (ran a program, printed output, failed), so none is written.
+ */
+void mark_rc_side_effect(void) {
+    if (sourcing_rc) {
+        rc_side_effects = 1;
+    }
+}
+
+/**
+ * Record that the rc file read an environment variable, so a snapshot
+ * of its results is only reused while that variable is unchanged.
+ *
+ * @param name Environment variable name
+ */
+void record_env_dependency(const char* name) {
+    for (int i = 0; i < rc_env_dep_count; i++) {
+        if (strcmp(rc_env_deps[i], name) == 0) {
+            return;
+        }
+    }
+    if (rc_env_dep_count == MAX_RC_ENV_DEPS ||
+        !(rc_env_deps[rc_env_dep_count] = strdup(name))) {
+        mark_rc_side_effect(); /* Cannot track it: do not snapshot */
+        return;
+    }
+    rc_env_dep_count++;
+}
+
+/**
+ * Look up a variable, preferring shell variables over the environment.
+ *
+ * @param name Variable name
+ * @return Variable value or NULL if unset
+ */
+const char* lookup_variable(const char* name) {
+    for (variable_t* var = variables[hash_name(name) % VARIABLE_HASH_SIZE]; var; var = var->next) {
+        if (strcmp(var->name, name) == 0) {
+            return var->value;
+        }
+    }
+    if (sourcing_rc) {
+        record_env_dependency(name);
+    }
+    return getenv(name);
+}
+
+/**
+ * Append the value of an expansion to a word being expanded. When
+ * splitting, whitespace in a value outside quotes separates fields.
+ *
+ * @param out Output buffer (see append_text)
+ * @param len Output length
+ * @param cap Output capacity
+ * @param value Value to append
+ * @param num_fields Field count when splitting, or NULL
+ * @param have_field Set while the current field is non-empty or quoted
+ * @return 0 on success, -1 on allocation failure
+ */
+int append_value(char** out, size_t* len, size_t* cap, const char* value,
+                 int* num_fields, int* have_field) {
+    if (!num_fields) {
+        return append_text(out, len, cap, value, strlen(value));
+    }
+    for (const char* v = value; *v; v++) {
+        if (!isspace((unsigned char)*v)) {
+            if (append_text(out, len, cap, v, 1) < 0) return -1;
+            *have_field = 1;
+        } else if (*have_field) {
+            if (append_text(out, len, cap, "", 1) < 0) return -1; /* End the field */
+            (*num_fields)++;
+            *have_field = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Expand a word, optionally splitting it into fields.
+ * Expands a leading ~, $?, $NAME and ${NAME} anywhere in the word.
+ * Shell variables take precedence over environment variables; unset
+ * variables expand to the empty string. A backslash (added by the
+ * lexer) makes the next character literal; \" marks a removed quote
+ * and expands to nothing.
+ *
+ * @param arg Word text from the lexer
+ * @param num_fields If not NULL, values of unquoted expansions are split
+ *                   on whitespace and this receives the number of fields,
+ *                   stored back to back as NUL-terminated strings
+ * @return Expanded text (caller must free), or NULL on allocation failure
+ */
+char* expand_word(const char* arg, int* num_fields) {
+    char* out = NULL;
+    size_t len = 0, cap = 0;
+    const char* ptr = arg ? arg : "";
+    int failed = append_text(&out, &len, &cap, "", 0);
+    int in_quotes = 0, have_field = 0;
+    int* split = NULL; /* num_fields outside quotes */
+
+    if (num_fields) {
+        *num_fields = 0;
+    }
+
     /* Check for ~ expansion (home directory) */
-    if (arg[0] == '~' && (arg[1] == '\0' || arg[1] == '/')) {
+    if (ptr[0] == '~' && (ptr[1] == '\0' || ptr[1] == '/')) {
         char* home = getenv("HOME");
-        if (home) {
-            char* expanded = malloc(strlen(home) + strlen(arg) + 1);
-            if (expanded) {
-                strcpy(expanded, home);
-                strcat(expanded, arg + 1); /* Skip the ~ */
-                return expanded;
+        if (sourcing_rc) record_env_dependency("HOME");
+        if (home && !failed) {
+            failed = append_text(&out, &len, &cap, home, strlen(home));
+            have_field = 1;
+            ptr++; /* Skip the ~ */
+        }
+    }
+
+    while (*ptr && !failed) {
+        const char* special = strpbrk(ptr, "$\\");
+        if (!special) {
+            failed = append_text(&out, &len, &cap, ptr, strlen(ptr));
+            have_field = 1;
+            break;
+        }
+        failed = append_text(&out, &len, &cap, ptr, special - ptr);
+        have_field |= special > ptr;
+        ptr = special + 1;
+        split = in_quotes ? NULL : num_fields;
+        if (*special == '\\') {
+            /* Escaped by the lexer: copy the next character as-is,
+               except \" which only marks where a quote was */
+            if (*ptr == '"') {
+                in_quotes = !in_quotes;
+                ptr++;
+            } else if (*ptr && !failed) {
+                failed = append_text(&out, &len, &cap, ptr, 1);
+                ptr++;
+            }
+            have_field = 1;
+            continue;
+        }
+
+        if (*ptr == '?') {
+            /* Exit status of the last command */
+            char status[16];
+            snprintf(status, sizeof(status), "%d", last_status);
+            if (!failed) failed = append_value(&out, &len, &cap, status, split, &have_field);
+            ptr++;
+        } else if (*ptr == '{' || isalpha((unsigned char)*ptr) || *ptr == '_') {
+            int braced = (*ptr == '{');
+            const char* start = braced ? ptr + 1 : ptr;
+            const char* end = start;
+            while (isalnum((unsigned char)*end) || *end == '_') {
+                end++;
+            }
+            if (braced && (*end != '}' || !is_valid_name(start, end - start))) {
+                /* Not a valid ${NAME}: keep the text as-is */
+                if (!failed) failed = append_text(&out, &len, &cap, "$", 1);
+                have_field = 1;
+                continue;
             }
+            char* name = strndup(start, end - start);
+            if (!name) {
+                failed = -1;
+                break;
+            }
+            const char* value = lookup_variable(name);
+            free(name);
+            if (value && !failed) failed = append_value(&out, &len, &cap, value, split, &have_field);
+            ptr = braced ? end + 1 : end;
+        } else if (!failed) {
+            failed = append_text(&out, &len, &cap, "$", 1);
+            have_field = 1;
         }
     }
-    
-    return strdup(arg); /* Return copy of original */
+
+    if (failed) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(out);
+        return NULL;
+    }
+    if (num_fields && have_field) {
+        (*num_fields)++; /* The last field ends at the final NUL */
+    }
+    return out;
+}
+
+/**
+ * Expand a word into a single argument (see expand_word).
+ *
+ * @param arg Word text from the lexer
+ * @return Expanded string (caller must free), or NULL on allocation failure
+ */
+char* expand_variables(const char* arg) {
+    return expand_word(arg, NULL);
 }
 
 /**
@@ -230,6 +749,86 @@ void show_aliases(void) {
     }
 }
 
+/**
+ * Hash a command name into a command lookup bucket.
+ *
+ * @param name Command name
+ * @return Bucket index
+ */
+unsigned int command_hash_bucket(const char* name) {
+    return hash_name(name) % COMMAND_HASH_SIZE;
+}
+
+/**
+ * Look up a cached command path.
+ *
+ * @param name Command name
+ * @return Cached path or NULL if not cached
+ */
+const char* lookup_hashed_command(const char* name) {
+    command_hash_entry_t* entry = command_hash[command_hash_bucket(name)];
+    while (entry) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry->path;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+/**
+ * Add or update a cached command path.
+ *
+ * @param name Command name
+ * @param path Resolved executable path
+ * @return 0 on success, -1 on allocation failure
+ */
+int hash_command(const char* name, const char* path) {
+    unsigned int bucket = command_hash_bucket(name);
+    command_hash_entry_t* entry = command_hash[bucket];
+
+    while (entry && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    char* path_copy = strdup(path);
+    if (!path_copy) return -1;
+    if (entry) {
+        free(entry->path);
+        entry->path = path_copy;
+        return 0;
+    }
+
+    entry = malloc(sizeof(command_hash_entry_t));
+    if (!entry || !(entry->name = strdup(name))) {
+        free(entry);
+        free(path_copy);
+        return -1;
+    }
+    entry->path = path_copy;
+    entry->next = command_hash[bucket];
+    command_hash[bucket] = entry;
+    hashed_count++;
+    return 0;
+}
+
+/**
+ * Forget all cached command paths (after the search paths change).
+ */
+void clear_command_hash(void) {
+    for (int i = 0; i < COMMAND_HASH_SIZE; i++) {
+        command_hash_entry_t* entry = command_hash[i];
+        while (entry) {
+            command_hash_entry_t* next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        command_hash[i] = NULL;
+    }
+    hashed_count = 0;
+}
+
 /**
  * Trim leading and trailing whitespace from a string.
  * Modifies the string in-place by moving the start pointer
@@ -262,489 +861,911 @@ char* trim_whitespace(char* str) {
 }
 
 /**
- * Free all tokens in a token array.
+ * Free all tokens in a token list.
  * 
- * @param tokens Array of token pointers to free
- * @param num_tokens Number of tokens in the array
+ * @param list Token list to free
  */
-void free_tokens(char* tokens[], int num_tokens) {
-    for (int i = 0; i < num_tokens; i++) {
-        if (tokens[i]) {
-            free(tokens[i]);
-            tokens[i] = NULL;
-        }
+void free_token_list(token_list_t* list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->tokens[i].text);
     }
+    free(list->tokens);
+    list->tokens = NULL;
+    list->count = 0;
+    list->capacity = 0;
 }
 
 /**
- * Tokenize a command string into individual arguments.
- * Handles quoted strings (both single and double quotes) and
- * properly separates tokens by whitespace.
+ * Append a token to a token list. Takes ownership of text.
  * 
- * @param cmd Command string to tokenize
- * @param tokens Array to store token pointers (caller must free)
- * @param max_tokens Maximum number of tokens to extract
- * @return Number of tokens found, or -1 on error
- */
-int tokenize_command(char* cmd, char* tokens[], int max_tokens) {
-    int num_tokens = 0;
-    char* ptr = cmd;
-    char* token_start = NULL;
-    int in_quotes = 0;
-    char quote_char = 0;
-    char* buffer = malloc(strlen(cmd) + 1);
-    int buffer_idx = 0;
+ * @param list Token list
+ * @param type Token type
+ * @param text Word text (TOK_WORD only, otherwise NULL)
+ * @return 0 on success, -1 on allocation failure
+ */
+int push_token(token_list_t* list, token_type_t type, char* text) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 32;
+        token_t* grown = realloc(list->tokens, new_capacity * sizeof(token_t));
+        if (!grown) {
+            free(text);
+            return -1;
+        }
+        list->tokens = grown;
+        list->capacity = new_capacity;
+    }
+    token_t* tok = &list->tokens[list->count++];
+    tok->type = type;
+    tok->text = text;
+    tok->quoted = 0;
+    tok->literal = 0;
+    tok->assignment = 0;
+    tok->from_alias = 0;
+    return 0;
+}
+
+/**
+ * Split input into words and operators.
+ * Handles quoted strings (both single and double quotes), # comments,
+ * and the operators ; && || | > and newline. Quoted parts of a word
+ * are joined with the unquoted parts around them. In words that will
+ * be expanded, backslashes and single-quoted $ and ~ are escaped with
+ * a backslash for expand_variables, and each quote is kept as \" so
+ * that it still ends a variable name ("$x"y is $x then y).
+ *
+ * @param input Input text, possibly spanning several lines
+ * @param list Token list to fill (caller must free), terminated by TOK_END
+ * @return 0 on success, -1 on error (already reported)
+ */
+int lex_input(const char* input, token_list_t* list) {
+    const char* ptr = input;
+    char* buffer = malloc(2 * strlen(input) + 1); /* Room for escapes */
 
     if (!buffer) {
         fprintf(stderr, "Memory allocation failed\n");
         return -1;
     }
 
-    while (*ptr && num_tokens < max_tokens) {
-        /* Handle whitespace outside quotes - token separator */
-        if (isspace((unsigned char)*ptr) && !in_quotes) {
-            if (token_start) {
-                buffer[buffer_idx] = '\0';
-                tokens[num_tokens] = strdup(buffer);
-                if (!tokens[num_tokens]) {
-                    free(buffer);
-                    return -1;
-                }
-                num_tokens++;
-                buffer_idx = 0;
-                token_start = NULL;
-            }
+    while (1) {
+        /* Skip whitespace other than newlines */
+        while (*ptr != '\n' && isspace((unsigned char)*ptr)) {
             ptr++;
-            continue;
         }
-
-        /* Handle opening quote */
-        if ((*ptr == '"' || *ptr == '\'') && !in_quotes) {
-            in_quotes = 1;
-            quote_char = *ptr;
-            token_start = ptr + 1;
-            ptr++;
-            continue;
+        if (*ptr == '\0') {
+            break;
         }
 
-        /* Handle closing quote */
-        if (*ptr == quote_char && in_quotes) {
-            buffer[buffer_idx] = '\0';
-            tokens[num_tokens] = strdup(buffer);
-            if (!tokens[num_tokens]) {
-                free(buffer);
-                return -1;
+        /* Comments run to the end of the line */
+        if (*ptr == '#') {
+            while (*ptr && *ptr != '\n') {
+                ptr++;
             }
-            num_tokens++;
-            buffer_idx = 0;
-            in_quotes = 0;
-            token_start = NULL;
-            ptr++;
             continue;
         }
 
-        /* Start new token if not in quotes */
-        if (!in_quotes && !token_start) {
-            token_start = ptr;
+        /* Operators (rc stays 1 when none matches) */
+        int rc = 1;
+        if (*ptr == '\n') {
+            rc = push_token(list, TOK_NEWLINE, NULL);
+            ptr++;
+        } else if (*ptr == ';') {
+            rc = push_token(list, TOK_SEMI, NULL);
+            ptr++;
+        } else if (*ptr == '&' && ptr[1] == '&') {
+            rc = push_token(list, TOK_AND, NULL);
+            ptr += 2;
+        } else if (*ptr == '|' && ptr[1] == '|') {
+            rc = push_token(list, TOK_OR, NULL);
+            ptr += 2;
+        } else if (*ptr == '|') {
+            rc = push_token(list, TOK_PIPE, NULL);
+            ptr++;
+        } else if (*ptr == '>') {
+            rc = push_token(list, TOK_REDIRECT, NULL);
+            ptr++;
+        }
+        if (rc < 0) {
+            goto alloc_failed;
+        }
+        if (rc == 0) {
+            continue;
         }
 
-        /* Add character to current token */
-        buffer[buffer_idx++] = *ptr++;
-    }
+        /* Word: read until whitespace or an operator outside quotes */
+        int buffer_idx = 0;
+        int quoted = 0, single = 0, unquoted = 0;
+        int name_prefix = 1, assignment = 0;
+        while (*ptr && !isspace((unsigned char)*ptr) && *ptr != ';' && *ptr != '|' &&
+               *ptr != '>' && !(*ptr == '&' && ptr[1] == '&')) {
+            if (*ptr == '"' || *ptr == '\'') {
+                char quote_char = *ptr++;
+                quoted = 1;
+                if (quote_char == '\'') {
+                    single = 1;
+                } else {
+                    unquoted = 1; /* Double quotes still expand variables */
+                }
+                if (!assignment) name_prefix = 0;
+                buffer[buffer_idx++] = '\\';
+                buffer[buffer_idx++] = '"';
+                while (*ptr && *ptr != quote_char) {
+                    /* Keep single-quoted text from being expanded */
+                    if (*ptr == '\\' || (quote_char == '\'' && (*ptr == '$' || *ptr == '~'))) {
+                        buffer[buffer_idx++] = '\\';
+                    }
+                    buffer[buffer_idx++] = *ptr++;
+                }
+                if (*ptr != quote_char) {
+                    fprintf(stderr, "An error has occurred: Unclosed quote\n");
+                    free(buffer);
+                    free_token_list(list);
+                    return -1;
+                }
+                buffer[buffer_idx++] = '\\';
+                buffer[buffer_idx++] = '"';
+                ptr++;
+                continue;
+            }
 
-    /* Handle the last token if present */
-    if (token_start && num_tokens < max_tokens) {
+            /* Track whether the word starts with NAME= */
+            if (name_prefix && !assignment) {
+                if (*ptr == '=' && buffer_idx > 0) {
+                    assignment = 1;
+                } else if (!(isalnum((unsigned char)*ptr) || *ptr == '_') ||
+                           (buffer_idx == 0 && isdigit((unsigned char)*ptr))) {
+                    name_prefix = 0;
+                }
+            }
+            unquoted = 1;
+            if (*ptr == '\\') {
+                buffer[buffer_idx++] = '\\';
+            }
+            buffer[buffer_idx++] = *ptr++;
+        }
+        if (single && !unquoted) {
+            /* Entirely single-quoted: never expanded, so drop the escapes */
+            int out = 0;
+            for (int i = 0; i < buffer_idx; i++) {
+                if (buffer[i] == '\\' && buffer[++i] == '"') continue;
+                buffer[out++] = buffer[i];
+            }
+            buffer_idx = out;
+        }
         buffer[buffer_idx] = '\0';
-        tokens[num_tokens] = strdup(buffer);
-        if (!tokens[num_tokens]) {
-            free(buffer);
-            return -1;
+
+        char* text = strdup(buffer);
+        if (!text || push_token(list, TOK_WORD, text) < 0) {
+            goto alloc_failed;
         }
-        num_tokens++;
+        token_t* tok = &list->tokens[list->count - 1];
+        tok->quoted = quoted;
+        tok->literal = single && !unquoted;
+        tok->assignment = assignment;
     }
 
-    /* Check for unclosed quotes */
-    if (in_quotes) {
-        fprintf(stderr, "An error has occurred: Unclosed quote\n");
-        for (int i = 0; i < num_tokens; i++) {
-            free(tokens[i]);
-        }
-        free(buffer);
+    free(buffer);
+    if (push_token(list, TOK_END, NULL) < 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free_token_list(list);
         return -1;
     }
+    return 0;
 
+alloc_failed:
+    fprintf(stderr, "Memory allocation failed\n");
     free(buffer);
-    return num_tokens;
+    free_token_list(list);
+    return -1;
 }
 
 /**
- * Main function - Entry point for the cmpsh shell.
- * 
- * Usage:
- *   ./cmpsh                 - Interactive mode
- *   ./cmpsh script.sh       - Non-interactive mode (execute script)
- * 
- * @param argc Argument count
- * @param argv Argument vector
- * @return Exit status (0 on success, 1 on error)
+ * Free a syntax tree node and all of its children.
+ *
+ * @param node Node to free (may be NULL)
  */
-int main(int argc, char* argv[]) {
-    FILE* input;
-    int interactive = 0;
-
-    /* Determine input source based on command-line arguments */
-    if (argc == 1) {
-        /* Interactive mode - read from stdin */
-        input = stdin;
-        interactive = 1;
-    } else if (argc == 2) {
-        /* Non-interactive mode - read from script file */
-        input = fopen(argv[1], "r");
-        if (input == NULL) {
-            fprintf(stderr, "An error has occurred: Cannot open file\n");
-            exit(1);
-        }
-    } else {
-        fprintf(stderr, "An error has occurred: Invalid arguments\n");
-        exit(1);
+void free_node(node_t* node) {
+    if (!node) return;
+    for (int i = 0; i < node->num_words; i++) {
+        free(node->words[i].text);
     }
-
-    /* Initialize default search paths with common system directories */
-    num_paths = 3;
-    paths = malloc(num_paths * sizeof(char*));
-    if (paths == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+    free(node->words);
+    if (node->redirect) {
+        free(node->redirect->text);
+        free(node->redirect);
     }
-    paths[0] = strdup("/bin");
-    paths[1] = strdup("/usr/bin");
-    paths[2] = strdup("/usr/local/bin");
-    
-    for (int i = 0; i < num_paths; i++) {
-        if (paths[i] == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            for (int j = 0; j < i; j++) {
-                free(paths[j]);
-            }
-            free(paths);
-            exit(1);
-        }
+    for (int i = 0; i < node->num_children; i++) {
+        free_node(node->children[i]);
     }
+    free(node->children);
+    free_node(node->cond);
+    free_node(node->body);
+    free_node(node->else_body);
+    free(node->name);
+    free(node);
+}
 
-    /* Set up signal handlers for proper signal propagation */
-    signal(SIGINT, sigint_handler);
-    signal(SIGTSTP, sigtstp_handler);
+/* Open constructs seen while reading a multi-line command */
+typedef struct {
+    int depth;               /* if/while/until/for not yet closed */
+    int command_start;       /* Nonzero if the next word starts a command */
+    int continued;           /* Nonzero after a trailing |, && or || */
+} nesting_t;
 
-    /* Main shell loop */
-    char line[MAX_LINE];
-    while (1) {
-        /* Display prompt in interactive mode */
-        if (interactive) {
-            printf("cmpsh> ");
-            fflush(stdout);
-        }
+/* Parser state over a token list */
+typedef struct {
+    token_list_t* list;      /* Tokens, terminated by TOK_END; aliases are spliced in */
+    int pos;                 /* Index of the next token */
+    parse_status_t status;   /* PARSE_OK until an error or early end */
+} parser_t;
 
-        /* Read input line */
-        if (fgets(line, MAX_LINE, input) == NULL) {
-            if (interactive) printf("\n");
-            break; /* EOF reached */
-        }
+/**
+ * Allocate an empty syntax tree node.
+ *
+ * @param p Parser (status is set on failure)
+ * @param type Node type
+ * @return New node or NULL on allocation failure
+ */
+node_t* new_node(parser_t* p, node_type_t type) {
+    node_t* node = calloc(1, sizeof(node_t));
+    if (!node) {
+        fprintf(stderr, "Memory allocation failed\n");
+        p->status = PARSE_ERROR;
+        return NULL;
+    }
+    node->type = type;
+    return node;
+}
 
-        /* Remove newline and trim whitespace */
-        line[strcspn(line, "\n")] = 0;
-        char* trimmed_line = trim_whitespace(line);
-        if (strlen(trimmed_line) == 0) {
-            continue; /* Skip empty lines */
-        }
+/**
+ * Append a child to a pipeline or list node.
+ *
+ * @param p Parser (status is set on failure)
+ * @param node Parent node
+ * @param child Child node (freed on failure)
+ * @return 0 on success, -1 on allocation failure
+ */
+int add_child(parser_t* p, node_t* node, node_t* child) {
+    node_t** grown = realloc(node->children, (node->num_children + 1) * sizeof(node_t*));
+    if (!grown) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free_node(child);
+        p->status = PARSE_ERROR;
+        return -1;
+    }
+    node->children = grown;
+    node->children[node->num_children++] = child;
+    return 0;
+}
 
-        /* Add command to history (only in interactive mode) */
-        if (interactive) {
-            add_to_history(trimmed_line);
-        }
+/**
+ * Append a word to a command or for-loop node.
+ *
+ * @param p Parser (status is set on failure)
+ * @param node Node receiving the word
+ * @param text Word text (copied)
+ * @param literal Nonzero to skip expansion
+ * @return 0 on success, -1 on allocation failure
+ */
+int add_word(parser_t* p, node_t* node, const char* text, int literal) {
+    word_t* grown = realloc(node->words, (node->num_words + 1) * sizeof(word_t));
+    char* copy = strdup(text);
+    if (grown) node->words = grown;
+    if (!grown || !copy) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(copy);
+        p->status = PARSE_ERROR;
+        return -1;
+    }
+    node->words[node->num_words].text = copy;
+    node->words[node->num_words].literal = literal;
+    node->num_words++;
+    return 0;
+}
+
+/**
+ * Return the next token without consuming it.
+ */
+token_t* peek_token(parser_t* p) {
+    return &p->list->tokens[p->pos];
+}
+
+/**
+ * Check whether a token is the given unquoted reserved word.
+ *
+ * @param tok Token to check
+ * @param keyword Reserved word
+ * @return 1 if it matches, 0 otherwise
+ */
+int is_keyword(const token_t* tok, const char* keyword) {
+    return tok->type == TOK_WORD && !tok->quoted && strcmp(tok->text, keyword) == 0;
+}
+
+/**
+ * Report a syntax error at a token.
+ * Reaching the end of input is not an error: the construct is
+ * incomplete and the caller should read another line.
+ *
+ * @param p Parser
+ * @param tok Offending token
+ */
+void syntax_error(parser_t* p, const token_t* tok) {
+    if (p->status != PARSE_OK) return;
+    if (tok->type == TOK_END) {
+        p->status = PARSE_INCOMPLETE;
+        return;
+    }
+
+    const char* text;
+    switch (tok->type) {
+    case TOK_WORD:     text = tok->text; break;
+    case TOK_PIPE:     text = "|"; break;
+    case TOK_AND:      text = "&&"; break;
+    case TOK_OR:       text = "||"; break;
+    case TOK_SEMI:     text = ";"; break;
+    case TOK_REDIRECT: text = ">"; break;
+    default:           text = "newline"; break;
+    }
+    fprintf(stderr, "An error has occurred: Syntax error near '%s'\n", text);
+    p->status = PARSE_ERROR;
+}
+
+/**
+ * Consume an expected reserved word.
+ *
+ * @param p Parser
+ * @param keyword Reserved word that must come next
+ * @return 0 on success, -1 on error
+ */
+int expect_keyword(parser_t* p, const char* keyword) {
+    token_t* tok = peek_token(p);
+    if (!is_keyword(tok, keyword)) {
+        syntax_error(p, tok);
+        return -1;
+    }
+    p->pos++;
+    return 0;
+}
+
+/**
+ * Skip newline tokens (allowed after && || | and before do/then).
+ */
+void skip_newlines(parser_t* p) {
+    while (peek_token(p)->type == TOK_NEWLINE) {
+        p->pos++;
+    }
+}
 
-        /* Parse pipeline commands separated by '|' */
-        char* commands[MAX_COMMANDS];
-        int num_commands = 0;
-        char* cmd = strtok(trimmed_line, "|");
-        while (cmd && num_commands < MAX_COMMANDS) {
-            commands[num_commands++] = trim_whitespace(cmd);
-            cmd = strtok(NULL, "|");
+/**
+ * Check whether a token is one of the reserved words ending a list.
+ *
+ * @param tok Token to check
+ * @param terminators NULL-terminated reserved words, or NULL
+ * @return 1 if it matches, 0 otherwise
+ */
+int is_terminator(const token_t* tok, const char* const* terminators) {
+    for (int i = 0; terminators && terminators[i]; i++) {
+        if (is_keyword(tok, terminators[i])) {
+            return 1;
         }
-        if (num_commands == 0) {
-            continue;
+    }
+    return 0;
+}
+
+node_t* parse_list(parser_t* p, const char* const* terminators);
+
+/**
+ * Replace the alias name at the current position with the tokens of
+ * its value, operators included, so that the alias is resolved once
+ * rather than every time the command runs. Spliced tokens are not
+ * expanded again, which lets an alias use a command of the same name.
+ *
+ * @param p Parser (status is set on failure)
+ * @param value Alias value
+ * @return Number of tokens spliced in, or -1 on failure (already reported)
+ */
+int splice_alias(parser_t* p, const char* value) {
+    token_list_t alias_tokens = {NULL, 0, 0};
+    token_list_t* list = p->list;
+
+    if (lex_input(value, &alias_tokens) < 0) {
+        p->status = PARSE_ERROR;
+        return -1;
+    }
+    int insert = alias_tokens.count - 1; /* Without TOK_END */
+    if (list->count + insert - 1 > list->capacity) {
+        token_t* grown = realloc(list->tokens, (list->count + insert - 1) * sizeof(token_t));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            free_token_list(&alias_tokens);
+            p->status = PARSE_ERROR;
+            return -1;
         }
+        list->tokens = grown;
+        list->capacity = list->count + insert - 1;
+    }
+
+    free(list->tokens[p->pos].text);
+    memmove(&list->tokens[p->pos + insert], &list->tokens[p->pos + 1],
+            (list->count - p->pos - 1) * sizeof(token_t));
+    memcpy(&list->tokens[p->pos], alias_tokens.tokens, insert * sizeof(token_t));
+    for (int i = 0; i < insert; i++) {
+        list->tokens[p->pos + i].from_alias = 1;
+    }
+    list->count += insert - 1;
+    free(alias_tokens.tokens); /* The texts now belong to list */
+    return insert;
+}
+
+/**
+ * Parse a simple command: words with an optional > redirection.
+ *
+ * @param p Parser
+ * @return Command node or NULL on error
+ */
+node_t* parse_simple_command(parser_t* p) {
+    node_t* cmd = new_node(p, NODE_COMMAND);
+    if (!cmd) return NULL;
 
-        /* Tokenize each command in the pipeline */
-        char* cmd_tokens[MAX_COMMANDS][MAX_TOKENS];
-        int cmd_num_tokens[MAX_COMMANDS];
-        for (int c = 0; c < num_commands; c++) {
-            for (int i = 0; i < MAX_TOKENS; i++) {
-                cmd_tokens[c][i] = NULL;
+    while (1) {
+        token_t* tok = peek_token(p);
+        if (tok->type == TOK_WORD) {
+            if (add_word(p, cmd, tok->text, tok->literal) < 0) {
+                free_node(cmd);
+                return NULL;
+            }
+            if (tok->assignment && cmd->num_assignments == cmd->num_words - 1) {
+                cmd->num_assignments++;
+            }
+            p->pos++;
+        } else if (tok->type == TOK_REDIRECT) {
+            p->pos++;
+            tok = peek_token(p);
+            if (tok->type != TOK_WORD) {
+                fprintf(stderr, "An error has occurred: Invalid redirection syntax\n");
+                p->status = PARSE_ERROR;
+                free_node(cmd);
+                return NULL;
+            }
+            if (cmd->redirect) {
+                free(cmd->redirect->text);
+            } else {
+                cmd->redirect = malloc(sizeof(word_t));
             }
-            cmd_num_tokens[c] = tokenize_command(commands[c], cmd_tokens[c], MAX_TOKENS);
-            if (cmd_num_tokens[c] < 0) {
-                goto cleanup_tokens;
+            if (cmd->redirect) {
+                cmd->redirect->text = strdup(tok->text);
+                cmd->redirect->literal = tok->literal;
             }
-            if (cmd_num_tokens[c] == 0) {
-                fprintf(stderr, "An error has occurred: Empty command\n");
-                goto cleanup_tokens;
+            if (!cmd->redirect || !cmd->redirect->text) {
+                fprintf(stderr, "Memory allocation failed\n");
+                p->status = PARSE_ERROR;
+                free_node(cmd);
+                return NULL;
             }
+            p->pos++;
+        } else {
+            break;
         }
+    }
 
-        // Handle alias resolution for first command
-        if (num_commands == 1) {
-            const char* alias_cmd = lookup_alias(cmd_tokens[0][0]);
-            if (alias_cmd) {
-                /* Simple alias expansion - replace first token only for now */
-                free(cmd_tokens[0][0]);
-                cmd_tokens[0][0] = strdup(alias_cmd);
-            }
+    if (cmd->num_words == 0) {
+        /* Only possible as "> file" with no command */
+        fprintf(stderr, "An error has occurred: Invalid redirection syntax\n");
+        p->status = PARSE_ERROR;
+        free_node(cmd);
+        return NULL;
+    }
+    return cmd;
+}
+
+/**
+ * Parse the part of an if after "if" or "elif", through the closing fi.
+ * An elif chain becomes nested if nodes in else_body.
+ *
+ * @param p Parser
+ * @return If node or NULL on error
+ */
+node_t* parse_if(parser_t* p) {
+    static const char* const cond_end[] = {"then", NULL};
+    static const char* const body_end[] = {"elif", "else", "fi", NULL};
+    static const char* const else_end[] = {"fi", NULL};
+
+    node_t* node = new_node(p, NODE_IF);
+    if (!node) return NULL;
+
+    if (!(node->cond = parse_list(p, cond_end)) || expect_keyword(p, "then") < 0 ||
+        !(node->body = parse_list(p, body_end))) {
+        free_node(node);
+        return NULL;
+    }
+
+    token_t* tok = peek_token(p);
+    p->pos++;
+    if (is_keyword(tok, "elif")) {
+        node->else_body = parse_if(p);
+    } else if (is_keyword(tok, "else")) {
+        node->else_body = parse_list(p, else_end);
+        if (node->else_body && expect_keyword(p, "fi") < 0) {
+            free_node(node);
+            return NULL;
         }
+    } else {
+        return node; /* fi */
+    }
+    if (!node->else_body) {
+        free_node(node);
+        return NULL;
+    }
+    return node;
+}
 
-        // Handle built-in commands (only if single command)
-        if (num_commands == 1) {
-            if (strcmp(cmd_tokens[0][0], "exit") == 0) {
-                if (cmd_num_tokens[0] != 1) {
-                    fprintf(stderr, "An error has occurred: exit takes no arguments\n");
-                } else {
-                    for (int i = 0; i < num_paths; i++) {
-                        free(paths[i]);
-                    }
-                    free(paths);
-                    if (input != stdin) fclose(input);
-                    exit(0);
-                }
-                continue;
-            } else if (strcmp(cmd_tokens[0][0], "cd") == 0) {
-                if (cmd_num_tokens[0] != 2) {
-                    fprintf(stderr, "An error has occurred: cd requires exactly one argument\n");
-                } else {
-                    if (chdir(cmd_tokens[0][1]) < 0) {
-                        fprintf(stderr, "An error has occurred: Cannot change directory\n");
-                    }
-                }
-                continue;
-            } else if (strcmp(cmd_tokens[0][0], "pwd") == 0) {
-                if (cmd_num_tokens[0] != 1) {
-                    fprintf(stderr, "An error has occurred: pwd takes no arguments\n");
-                } else {
-                    char cwd[MAX_LINE];
-                    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-                        printf("%s\n", cwd);
-                    } else {
-                        fprintf(stderr, "An error has occurred: Cannot get current directory\n");
-                    }
-                }
-                continue;
-            } else if (strcmp(cmd_tokens[0][0], "help") == 0) {
-                if (cmd_num_tokens[0] != 1) {
-                    fprintf(stderr, "An error has occurred: help takes no arguments\n");
-                } else {
-                    printf("cmpsh - Custom Shell Implementation\n");
-                    printf("Built-in commands:\n");
-                    printf("  exit        - Exit the shell\n");
-                    printf("  cd <dir>    - Change directory\n");
-                    printf("  pwd         - Print working directory\n");
-                    printf("  path <dirs> - Set executable search paths\n");
-                    printf("  help        - Show this help message\n");
-                    printf("  env         - Show environment variables\n");
-                    printf("  history     - Show command history\n");
-                    printf("  alias       - Show/set command aliases\n");
-                    printf("\nFeatures:\n");
-                    printf("  - Piping: command1 | command2\n");
-                    printf("  - Redirection: command > file\n");
-                    printf("  - Signal handling: Ctrl+C, Ctrl+Z\n");
-                }
-                continue;
-            } else if (strcmp(cmd_tokens[0][0], "env") == 0) {
-                if (cmd_num_tokens[0] != 1) {
-                    fprintf(stderr, "An error has occurred: env takes no arguments\n");
-                } else {
-                    extern char **environ;
-                    for (char **env = environ; *env != NULL; env++) {
-                        printf("%s\n", *env);
-                    }
-                }
-                continue;
-            } else if (strcmp(cmd_tokens[0][0], "history") == 0) {
-                if (cmd_num_tokens[0] != 1) {
-                    fprintf(stderr, "An error has occurred: history takes no arguments\n");
-                } else {
-                    show_history();
-                }
-                continue;
-            } else if (strcmp(cmd_tokens[0][0], "alias") == 0) {
-                if (cmd_num_tokens[0] == 1) {
-                    /* Show all aliases */
-                    show_aliases();
-                } else if (cmd_num_tokens[0] == 3) {
-                    /* Add/update alias: alias name command */
-                    if (add_alias(cmd_tokens[0][1], cmd_tokens[0][2]) == 0) {
-                        printf("Alias '%s' set to '%s'\n", cmd_tokens[0][1], cmd_tokens[0][2]);
-                    } else {
-                        fprintf(stderr, "An error has occurred: Cannot set alias\n");
-                    }
-                } else {
-                    fprintf(stderr, "An error has occurred: alias usage: alias [name command]\n");
-                }
-                continue;
-            } else if (strcmp(cmd_tokens[0][0], "path") == 0 || strcmp(cmd_tokens[0][0], "paths") == 0) {
-                if (cmd_num_tokens[0] < 2) {
-                    fprintf(stderr, "An error has occurred: path requires at least one argument\n");
-                } else {
-                    // Free existing paths
-                    for (int i = 0; i < num_paths; i++) {
-                        free(paths[i]);
-                    }
-                    free(paths);
-
-                    // Allocate new paths array
-                    num_paths = cmd_num_tokens[0] - 1;
-                    paths = malloc(num_paths * sizeof(char*));
-                    if (paths == NULL) {
-                        fprintf(stderr, "Memory allocation failed\n");
-                        num_paths = 0;
-                        continue;
-                    }
+/**
+ * Parse "cond; do body; done" after "while" or "until".
+ *
+ * @param p Parser
+ * @param negate Nonzero for until
+ * @return While node or NULL on error
+ */
+node_t* parse_while(parser_t* p, int negate) {
+    static const char* const cond_end[] = {"do", NULL};
+    static const char* const body_end[] = {"done", NULL};
 
-                    // Copy new paths
-                    for (int i = 0; i < num_paths; i++) {
-                        paths[i] = strdup(cmd_tokens[0][i + 1]);
-                        if (paths[i] == NULL) {
-                            for (int j = 0; j < i; j++) {
-                                free(paths[j]);
-                            }
-                            free(paths);
-                            paths = NULL;
-                            num_paths = 0;
-                            fprintf(stderr, "Memory allocation failed\n");
-                            continue;
-                        }
-                    }
-                }
-                continue;
-            }
+    node_t* node = new_node(p, NODE_WHILE);
+    if (!node) return NULL;
+    node->negate = negate;
+
+    if (!(node->cond = parse_list(p, cond_end)) || expect_keyword(p, "do") < 0 ||
+        !(node->body = parse_list(p, body_end)) || expect_keyword(p, "done") < 0) {
+        free_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Parse "name in words; do body; done" after "for".
+ *
+ * @param p Parser
+ * @return For node or NULL on error
+ */
+node_t* parse_for(parser_t* p) {
+    static const char* const body_end[] = {"done", NULL};
+
+    node_t* node = new_node(p, NODE_FOR);
+    if (!node) return NULL;
+
+    token_t* tok = peek_token(p);
+    if (tok->type != TOK_WORD || tok->quoted || !is_valid_name(tok->text, strlen(tok->text))) {
+        syntax_error(p, tok);
+        free_node(node);
+        return NULL;
+    }
+    node->name = strdup(tok->text);
+    if (!node->name) {
+        fprintf(stderr, "Memory allocation failed\n");
+        p->status = PARSE_ERROR;
+        free_node(node);
+        return NULL;
+    }
+    p->pos++;
+
+    skip_newlines(p);
+    if (expect_keyword(p, "in") < 0) {
+        free_node(node);
+        return NULL;
+    }
+    while ((tok = peek_token(p))->type == TOK_WORD) {
+        if (add_word(p, node, tok->text, tok->literal) < 0) {
+            free_node(node);
+            return NULL;
         }
+        p->pos++;
+    }
 
-        int redirect = -1;
-        if (num_commands == 1) {
-            for (int i = 0; i < cmd_num_tokens[0]; i++) {
-                if (strcmp(cmd_tokens[0][i], ">") == 0) {
-                    redirect = i;
-                    break;
-                }
+    /* The value list must be terminated before do */
+    if (tok->type != TOK_SEMI && tok->type != TOK_NEWLINE) {
+        syntax_error(p, tok);
+        free_node(node);
+        return NULL;
+    }
+    while ((tok = peek_token(p))->type == TOK_SEMI || tok->type == TOK_NEWLINE) {
+        p->pos++;
+    }
+
+    if (expect_keyword(p, "do") < 0 || !(node->body = parse_list(p, body_end)) ||
+        expect_keyword(p, "done") < 0) {
+        free_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Parse one command: a compound command or a simple command.
+ *
+ * @param p Parser
+ * @return Command node or NULL on error
+ */
+node_t* parse_command(parser_t* p) {
+    token_t* tok = peek_token(p);
+
+    if (tok->type == TOK_WORD && !tok->quoted && !tok->from_alias) {
+        const char* alias_cmd = lookup_alias(tok->text);
+        if (alias_cmd) {
+            int spliced = splice_alias(p, alias_cmd);
+            if (spliced < 0) {
+                return NULL;
             }
-            if (redirect != -1) {
-                if (redirect == 0 || redirect == cmd_num_tokens[0] - 1 || redirect != cmd_num_tokens[0] - 2) {
-                    fprintf(stderr, "An error has occurred: Invalid redirection syntax\n");
-                    continue;
-                }
+            tok = peek_token(p);
+            if (spliced == 0 && tok->type != TOK_WORD && tok->type != TOK_REDIRECT) {
+                /* An empty alias runs as an empty command, like $e with e= */
+                return new_node(p, NODE_COMMAND);
             }
         }
+    }
+    if (tok->type != TOK_WORD) {
+        syntax_error(p, tok);
+        return NULL;
+    }
+    if (is_keyword(tok, "if")) {
+        p->pos++;
+        return parse_if(p);
+    }
+    if (is_keyword(tok, "while") || is_keyword(tok, "until")) {
+        p->pos++;
+        return parse_while(p, tok->text[0] == 'u');
+    }
+    if (is_keyword(tok, "for")) {
+        p->pos++;
+        return parse_for(p);
+    }
+    if (is_keyword(tok, "then") || is_keyword(tok, "elif") || is_keyword(tok, "else") ||
+        is_keyword(tok, "fi") || is_keyword(tok, "do") || is_keyword(tok, "done")) {
+        syntax_error(p, tok);
+        return NULL;
+    }
+    return parse_simple_command(p);
+}
 
-        int pipe_fds[MAX_COMMANDS - 1][2];
-        for (int i = 0; i < num_commands - 1; i++) {
-            if (pipe(pipe_fds[i]) < 0) {
-                fprintf(stderr, "An error has occurred: Cannot create pipe \n");
-                continue;
-            }
+/**
+ * Parse commands joined by |.
+ *
+ * @param p Parser
+ * @return Command node, pipeline node, or NULL on error
+ */
+node_t* parse_pipeline(parser_t* p) {
+    node_t* first = parse_command(p);
+    if (!first || peek_token(p)->type != TOK_PIPE) {
+        return first;
+    }
+
+    node_t* pipeline = new_node(p, NODE_PIPELINE);
+    if (!pipeline || add_child(p, pipeline, first) < 0) {
+        if (!pipeline) free_node(first);
+        free_node(pipeline);
+        return NULL;
+    }
+    while (peek_token(p)->type == TOK_PIPE) {
+        p->pos++;
+        skip_newlines(p);
+        if (pipeline->num_children == MAX_COMMANDS) {
+            fprintf(stderr, "An error has occurred: Too many commands in pipeline\n");
+            p->status = PARSE_ERROR;
+            free_node(pipeline);
+            return NULL;
         }
+        node_t* stage = parse_command(p);
+        if (!stage || add_child(p, pipeline, stage) < 0) {
+            free_node(pipeline);
+            return NULL;
+        }
+    }
+    return pipeline;
+}
 
-        pid_t pids[MAX_COMMANDS];
-        for (int c = 0; c < num_commands; c++) {
-            char full_path[MAX_LINE];
-            int found = 0;
-            for (int i = 0; i < num_paths; i++) {
-                snprintf(full_path, sizeof(full_path), "%s/%s", paths[i], cmd_tokens[c][0]);
-                if (access(full_path, X_OK) == 0) {
-                    found = 1;
-                    break;
-                }
-            }
-            if (!found) {
-                snprintf(full_path, sizeof(full_path), "%s", cmd_tokens[c][0]);
-                if (access(full_path, X_OK) == 0) {
-                    found = 1;
-                }
-            }
-            if (!found) {
-                fprintf(stderr, "An error has occurred: Command not found\n");
-                for (int i = 0; i < num_commands - 1; i++) {
-                    close(pipe_fds[i][0]);
-                    close(pipe_fds[i][1]);
-                }
-                break;
-            }
+/**
+ * Parse pipelines joined by && and ||, evaluated left to right.
+ *
+ * @param p Parser
+ * @return Syntax tree or NULL on error
+ */
+node_t* parse_and_or(parser_t* p) {
+    node_t* left = parse_pipeline(p);
 
-            pids[c] = fork();
-            if (pids[c] == 0) {
-                // Child process
-                if (c > 0) {
-                    dup2(pipe_fds[c-1][0], STDIN_FILENO);
-                }
-                if (c < num_commands - 1) {
-                    dup2(pipe_fds[c][1], STDOUT_FILENO);
-                }
-                if (c == num_commands - 1 && redirect != -1) {
-                    char* output_file = cmd_tokens[0][redirect + 1];
-                    int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    if (fd < 0) {
-                        fprintf(stderr, "An error has occurred: Cannot open output file\n");
-                        exit(1);
-                    }
-                    dup2(fd, STDOUT_FILENO);
-                    close(fd);
-                    cmd_tokens[0][redirect] = NULL;
-                }
+    while (left) {
+        token_type_t op = peek_token(p)->type;
+        if (op != TOK_AND && op != TOK_OR) {
+            break;
+        }
+        p->pos++;
+        skip_newlines(p);
 
-                for (int i = 0; i < num_commands - 1; i++) {
-                    close(pipe_fds[i][0]);
-                    close(pipe_fds[i][1]);
-                }
+        node_t* node = new_node(p, op == TOK_AND ? NODE_AND : NODE_OR);
+        if (!node) {
+            free_node(left);
+            return NULL;
+        }
+        node->cond = left;
+        left = node;
+        if (!(node->body = parse_pipeline(p))) {
+            free_node(node);
+            return NULL;
+        }
+    }
+    return left;
+}
 
-                execv(full_path, cmd_tokens[c]);
-                fprintf(stderr, "An error has occurred: Failed to execute\n");
-                exit(1);
-            } else if (pids[c] < 0) {
-                fprintf(stderr, "An error has occurred: Fork failed \n");
-                for (int i = 0; i < num_commands - 1; i++) {
-                    close(pipe_fds[i][0]);
-                    close(pipe_fds[i][1]);
-                }
+/**
+ * Parse a sequence of commands separated by ; or newlines.
+ *
+ * @param p Parser
+ * @param terminators NULL-terminated reserved words that end the list,
+ *                    or NULL for the top level (ends at end of input)
+ * @return List node (unwrapped if it has a single entry) or NULL on error
+ */
+node_t* parse_list(parser_t* p, const char* const* terminators) {
+    node_t* list = new_node(p, NODE_LIST);
+    if (!list) return NULL;
+
+    while (1) {
+        skip_newlines(p);
+        token_t* tok = peek_token(p);
+
+        if (tok->type == TOK_END) {
+            if (terminators) {
+                syntax_error(p, tok); /* Incomplete */
+                free_node(list);
+                return NULL;
             }
+            break;
         }
 
-        for (int i = 0; i < num_commands - 1; i++) {
-            close(pipe_fds[i][0]);
-            close(pipe_fds[i][1]);
+        if (is_terminator(tok, terminators)) {
+            break;
         }
 
-        // Wait for all children
-        for (int c = 0; c < num_commands; c++) {
-            if (pids[c] > 0) {
-                current_child = pids[c];
-                int status;
-                while (waitpid(pids[c], &status, 0) < 0) {
-                    if (errno != EINTR) {
-                        fprintf(stderr, "An error has occurred: Waitpid failed\n");
-                        break;
-                    }
-                }
-                current_child = -1;
+        node_t* item = parse_and_or(p);
+        if (!item || add_child(p, list, item) < 0) {
+            free_node(list);
+            return NULL;
+        }
+
+        /* Commands must be separated, except before a terminator */
+        tok = peek_token(p);
+        if (tok->type == TOK_SEMI || tok->type == TOK_NEWLINE) {
+            p->pos++;
+        } else if (tok->type != TOK_END && !is_terminator(tok, terminators)) {
+            syntax_error(p, tok);
+            free_node(list);
+            return NULL;
+        }
+    }
+
+    if (terminators && list->num_children == 0) {
+        syntax_error(p, peek_token(p));
+        free_node(list);
+        return NULL;
+    }
+    if (list->num_children == 1) {
+        node_t* only = list->children[0];
+        list->num_children = 0;
+        free_node(list);
+        return only;
+    }
+    return list;
+}
+
+/**
+ * Parse a complete program from lexed tokens.
+ *
+ * @param list Tokens, terminated by TOK_END (not freed)
+ * @param program Receives the syntax tree on PARSE_OK (caller must free)
+ * @return PARSE_OK, PARSE_INCOMPLETE or PARSE_ERROR
+ */
+parse_status_t parse_tokens(token_list_t* list, node_t** program) {
+    parser_t parser;
+
+    *program = NULL;
+    parser.list = list;
+    parser.pos = 0;
+    parser.status = PARSE_OK;
+
+    node_t* tree = parse_list(&parser, NULL);
+    if (parser.status != PARSE_OK) {
+        free_node(tree);
+        return parser.status;
+    }
+    *program = tree;
+    return PARSE_OK;
+}
+
+/**
+ * Lex and parse a complete program.
+ *
+ * @param input Input text (one or more lines)
+ * @param program Receives the syntax tree on PARSE_OK (caller must free)
+ * @return PARSE_OK, PARSE_INCOMPLETE or PARSE_ERROR
+ */
+parse_status_t parse_program(const char* input, node_t** program) {
+    token_list_t list = {NULL, 0, 0};
+
+    *program = NULL;
+    if (lex_input(input, &list) < 0) {
+        return PARSE_ERROR;
+    }
+    parse_status_t status = parse_tokens(&list, program);
+    free_token_list(&list);
+    return status;
+}
+
+/**
+ * Track the constructs left open by newly lexed tokens, so that a
+ * multi-line command is parsed once when it may be complete instead of
+ * after every line. Only reserved words in command position count, as
+ * in the parser.
+ *
+ * @param nesting State carried across the lines of one command
+ * @param tokens New tokens (without TOK_END)
+ * @param count Number of new tokens
+ * @return 1 if the tokens read so far may form a complete program
+ */
+int scan_nesting(nesting_t* nesting, const token_t* tokens, int count) {
+    static const char* const openers[] = {"if", "while", "until", "for", NULL};
+    static const char* const starters[] = {
+        "if", "then", "elif", "else", "while", "until", "do", NULL
+    };
+
+    for (int i = 0; i < count; i++) {
+        const token_t* tok = &tokens[i];
+        if (tok->type != TOK_WORD) {
+            /* The word after > is a file name, not a command */
+            nesting->command_start = tok->type != TOK_REDIRECT;
+            if (tok->type != TOK_NEWLINE) {
+                nesting->continued = tok->type == TOK_PIPE || tok->type == TOK_AND ||
+                                     tok->type == TOK_OR;
             }
+            continue;
+        }
+        nesting->continued = 0;
+        if (!nesting->command_start) {
+            continue;
+        }
+        if (is_keyword(tok, "fi") || is_keyword(tok, "done")) {
+            nesting->depth--;
         }
-cleanup_tokens:
-        for (int c = 0; c < num_commands; c++) {
-            free_tokens(cmd_tokens[c], cmd_num_tokens[c]);
+        for (int k = 0; openers[k]; k++) {
+            if (is_keyword(tok, openers[k])) {
+                nesting->depth++;
+            }
+        }
+        nesting->command_start = 0;
+        for (int k = 0; starters[k]; k++) {
+            if (is_keyword(tok, starters[k])) {
+                nesting->command_start = 1;
+            }
         }
     }
+    return nesting->depth <= 0 && !nesting->continued;
+}
 
-    // Cleanup
+/**
+ * Free all search paths and the command lookups resolved through them.
+ */
+void free_paths(void) {
     for (int i = 0; i < num_paths; i++) {
         free(paths[i]);
     }
     free(paths);
-    
+    paths = NULL;
+    num_paths = 0;
+    clear_command_hash();
+}
+
+/**
+ * Release all shell state before exiting.
+ */
+void cleanup_shell(void) {
+    free_paths();
+
     /* Cleanup command history */
     if (command_history) {
         for (int i = 0; i < history_count && i < MAX_HISTORY; i++) {
@@ -753,17 +1774,2058 @@ cleanup_tokens:
             }
         }
         free(command_history);
+        command_history = NULL;
+        history_count = 0;
     }
-    
+
     /* Cleanup aliases */
     for (int i = 0; i < alias_count; i++) {
         if (aliases[i].name) free(aliases[i].name);
         if (aliases[i].command) free(aliases[i].command);
     }
-    
-    if (input != stdin) {
-        fclose(input);
+    alias_count = 0;
+
+    /* Cleanup variables */
+    clear_variables();
+
+    for (int i = 0; i < rc_env_dep_count; i++) {
+        free(rc_env_deps[i]);
     }
+    rc_env_dep_count = 0;
 
-    return 0;
-}
\ No newline at end of file
+    free_node(current_program);
+    current_program = NULL;
+    free_token_list(&input_tokens);
+
+    if (input_stream && input_stream != stdin) {
+        fclose(input_stream);
+    }
+    input_stream = NULL;
+}
+
+/**
+ * Clean up and terminate the shell, writing final metrics.
+ * A forked pipeline stage only flushes its output.
+ *
+ * @param status Exit status
+ */
+void shell_exit(int status) {
+    if (in_child) {
+        /* exit() would close the shared input stream and move its offset */
+        fflush(stdout);
+        _exit(status);
+    }
+    write_metrics_file();
+    cleanup_shell();
+    exit(status);
+}
+
+/**
+ * Microseconds elapsed since a monotonic start time.
+ *
+ * @param since Start time from clock_gettime(CLOCK_MONOTONIC)
+ * @return Elapsed microseconds
+ */
+long elapsed_us(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/**
+ * Map the counter block shared with forked children, so that work done
+ * after fork() (pipeline stages, exec failures, fork-to-exec timing)
+ * is visible to the shell. Without it, children's counts are dropped.
+ */
+void init_metrics(void) {
+    void* shared = mmap(NULL, sizeof(metrics_t), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED) {
+        child_metrics = shared; /* Zero-filled by mmap */
+    }
+}
+
+/**
+ * Switch a newly forked child to the shared counter block.
+ */
+void use_child_metrics(void) {
+    if (child_metrics) {
+        metrics = child_metrics;
+        metrics_atomic = 1;
+    }
+}
+
+/**
+ * Sum the shell's and the children's counters.
+ * Async-signal-safe.
+ *
+ * @param out Receives the totals
+ */
+void collect_metrics(metrics_t* out) {
+    const unsigned long long* own = (const unsigned long long*)&shell_metrics;
+    const unsigned long long* shared = (const unsigned long long*)child_metrics;
+    unsigned long long* total = (unsigned long long*)out;
+    size_t n = sizeof(metrics_t) / sizeof(unsigned long long);
+
+    for (size_t i = 0; i < n; i++) {
+        total[i] = own[i];
+        if (shared) {
+            total[i] += __atomic_load_n(&shared[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Record an observation in a histogram.
+ *
+ * @param hist Histogram
+ * @param bounds Bucket upper bounds (ascending)
+ * @param num_bounds Number of bounds
+ * @param value Observed value
+ */
+void observe_histogram(histogram_t* hist, const unsigned long long* bounds, int num_bounds,
+                       unsigned long long value) {
+    int i = 0;
+    while (i < num_bounds && value > bounds[i]) {
+        i++;
+    }
+    METRIC_ADD(hist->buckets[i], 1);
+    METRIC_ADD(hist->count, 1);
+    METRIC_ADD(hist->sum, value);
+}
+
+/* Fixed-size text buffer; the append helpers below are async-signal-safe */
+typedef struct {
+    char* buf;               /* Output buffer */
+    size_t size;             /* Buffer size */
+    size_t len;              /* Bytes written (truncated at size - 1) */
+} text_buf_t;
+
+/**
+ * Append a string to a text buffer, truncating if full.
+ */
+void text_puts(text_buf_t* text, const char* str) {
+    while (*str && text->len + 1 < text->size) {
+        text->buf[text->len++] = *str++;
+    }
+    text->buf[text->len] = '\0';
+}
+
+/**
+ * Append an unsigned decimal number, zero-padded to min_digits.
+ */
+void text_putu(text_buf_t* text, unsigned long long value, int min_digits) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0 || n < min_digits);
+    char out[24];
+    for (int i = 0; i < n; i++) {
+        out[i] = digits[n - 1 - i];
+    }
+    out[n] = '\0';
+    text_puts(text, out);
+}
+
+/**
+ * Append a microsecond value formatted as seconds.
+ */
+void text_put_seconds(text_buf_t* text, unsigned long long us) {
+    text_putu(text, us / 1000000, 1);
+    text_puts(text, ".");
+    text_putu(text, us % 1000000, 6);
+}
+
+/**
+ * Append a counter in Prometheus text format.
+ */
+void format_counter(text_buf_t* text, const char* name, const char* help,
+                    unsigned long long value) {
+    text_puts(text, "# HELP ");
+    text_puts(text, name);
+    text_puts(text, " ");
+    text_puts(text, help);
+    text_puts(text, "\n# TYPE ");
+    text_puts(text, name);
+    text_puts(text, " counter\n");
+    text_puts(text, name);
+    text_puts(text, " ");
+    text_putu(text, value, 1);
+    text_puts(text, "\n");
+}
+
+/**
+ * Append a histogram in Prometheus text format.
+ *
+ * @param text Output buffer
+ * @param name Metric name
+ * @param help Help text
+ * @param hist Histogram
+ * @param bounds Bucket upper bounds
+ * @param num_bounds Number of bounds
+ * @param seconds Nonzero if values are microseconds exported as seconds
+ */
+void format_histogram(text_buf_t* text, const char* name, const char* help,
+                      const histogram_t* hist, const unsigned long long* bounds,
+                      int num_bounds, int seconds) {
+    unsigned long long cumulative = 0;
+
+    text_puts(text, "# HELP ");
+    text_puts(text, name);
+    text_puts(text, " ");
+    text_puts(text, help);
+    text_puts(text, "\n# TYPE ");
+    text_puts(text, name);
+    text_puts(text, " histogram\n");
+    for (int i = 0; i <= num_bounds; i++) {
+        cumulative += hist->buckets[i];
+        text_puts(text, name);
+        text_puts(text, "_bucket{le=\"");
+        if (i == num_bounds) {
+            text_puts(text, "+Inf");
+        } else if (seconds) {
+            text_put_seconds(text, bounds[i]);
+        } else {
+            text_putu(text, bounds[i], 1);
+        }
+        text_puts(text, "\"} ");
+        text_putu(text, cumulative, 1);
+        text_puts(text, "\n");
+    }
+    text_puts(text, name);
+    text_puts(text, "_sum ");
+    if (seconds) {
+        text_put_seconds(text, hist->sum);
+    } else {
+        text_putu(text, hist->sum, 1);
+    }
+    text_puts(text, "\n");
+    text_puts(text, name);
+    text_puts(text, "_count ");
+    text_putu(text, hist->count, 1);
+    text_puts(text, "\n");
+}
+
+/**
+ * Format all metrics in Prometheus text exposition format.
+ * Async-signal-safe, so it can run from the export signal handler.
+ *
+ * @param buf Output buffer
+ * @param size Buffer size
+ * @return Length of the text
+ */
+size_t format_prometheus(char* buf, size_t size) {
+    text_buf_t text = {buf, size, 0};
+    metrics_t totals;
+    const metrics_t* m = &totals;
+
+    collect_metrics(&totals);
+    buf[0] = '\0';
+    format_counter(&text, "cmpsh_commands_total", "Simple commands executed.", m->commands);
+    format_counter(&text, "cmpsh_builtins_total", "Built-in commands run.", m->builtins);
+    format_counter(&text, "cmpsh_forks_total", "Child processes forked.", m->forks);
+    format_counter(&text, "cmpsh_fork_failures_total", "Failed fork() calls.", m->fork_failures);
+    format_counter(&text, "cmpsh_exec_failures_total", "Failed execv() calls.", m->exec_failures);
+    format_counter(&text, "cmpsh_command_not_found_total", "Command not found errors.", m->not_found);
+    format_counter(&text, "cmpsh_path_lookup_hits_total", "Path lookups answered from the command cache.", m->path_hits);
+    format_counter(&text, "cmpsh_path_lookup_misses_total", "Path lookups that searched the paths.", m->path_misses);
+    format_histogram(&text, "cmpsh_fork_exec_latency_seconds", "Time from fork() to execv() in the child.",
+                     &m->fork_exec_us, latency_bounds_us, NUM_LATENCY_BOUNDS, 1);
+    format_histogram(&text, "cmpsh_wait_seconds", "Time spent waiting for launched pipelines.",
+                     &m->wait_us, latency_bounds_us, NUM_LATENCY_BOUNDS, 1);
+    format_histogram(&text, "cmpsh_pipeline_depth", "Stages per launched pipeline.",
+                     &m->pipeline_depth, depth_bounds, NUM_DEPTH_BOUNDS, 0);
+    return text.len;
+}
+
+/**
+ * Write the metrics to the configured file, replacing it atomically.
+ * Uses only async-signal-safe calls.
+ */
+void write_metrics_file(void) {
+    char text[METRICS_TEXT_SIZE];
+    char tmp_file[MAX_LINE + 32];
+    text_buf_t tmp_name = {tmp_file, sizeof(tmp_file), 0};
+
+    if (!metrics_file) return;
+    text_puts(&tmp_name, metrics_file);
+    text_puts(&tmp_name, ".");
+    text_putu(&tmp_name, (unsigned long long)getpid(), 1);
+    text_puts(&tmp_name, ".tmp");
+
+    size_t len = format_prometheus(text, sizeof(text));
+    int fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, text + written, len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    close(fd);
+    if (written == len) {
+        rename(tmp_file, metrics_file);
+    } else {
+        unlink(tmp_file);
+    }
+}
+
+/**
+ * Signal handler for SIGUSR1 and SIGALRM: export metrics,
+ * re-arming the timer for interval exports.
+ *
+ * @param sig Signal number
+ */
+void metrics_signal_handler(int sig) {
+    int saved_errno = errno;
+    if (sig == SIGALRM && metrics_interval > 0) {
+        alarm(metrics_interval);
+    }
+    write_metrics_file();
+    errno = saved_errno;
+}
+
+/**
+ * Print metrics in human-readable form for the stats built-in.
+ */
+void show_stats(void) {
+    metrics_t totals;
+    const metrics_t* m = &totals;
+    const histogram_t* latency[] = {&m->fork_exec_us, &m->wait_us};
+    const char* const latency_names[] = {"fork-to-exec latency:", "wait time:"};
+
+    collect_metrics(&totals);
+    printf("commands executed:     %llu\n", m->commands);
+    printf("built-ins run:         %llu\n", m->builtins);
+    printf("forks:                 %llu (%llu failed)\n", m->forks, m->fork_failures);
+    printf("exec failures:         %llu\n", m->exec_failures);
+    printf("command not found:     %llu\n", m->not_found);
+    printf("path lookups:          %llu hits, %llu misses\n", m->path_hits, m->path_misses);
+    for (int i = 0; i < 2; i++) {
+        printf("%-23s%llu samples", latency_names[i], latency[i]->count);
+        if (latency[i]->count > 0) {
+            printf(", avg %llu us", latency[i]->sum / latency[i]->count);
+        }
+        printf("\n");
+    }
+    printf("pipeline depth:        %llu pipelines", m->pipeline_depth.count);
+    if (m->pipeline_depth.count > 0) {
+        printf(", avg %.2f stages", (double)m->pipeline_depth.sum / m->pipeline_depth.count);
+    }
+    printf("\n");
+}
+
+/**
+ * Parse a whole string as a decimal integer.
+ *
+ * @param text String to parse
+ * @param value Receives the number
+ * @return 0 on success, -1 if text is not an integer
+ */
+int parse_long(const char* text, long* value) {
+    char* end;
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return (*text == '\0' || *end != '\0' || errno != 0) ? -1 : 0;
+}
+
+/**
+ * Check whether a CPU is in a list.
+ */
+int cpu_list_has(const cpu_list_t* list, int cpu) {
+    return (list->bits[cpu / 8] >> (cpu % 8)) & 1;
+}
+
+/**
+ * Parse a CPU list such as "0-3,8,10-11".
+ *
+ * @param text CPU list
+ * @param list Receives the CPUs
+ * @return 0 on success, -1 if the list is malformed or empty
+ */
+int parse_cpu_list(const char* text, cpu_list_t* list) {
+    const char* p = text;
+
+    memset(list, 0, sizeof(*list));
+    while (*p) {
+        char* end;
+        if (!isdigit((unsigned char)*p)) {
+            return -1;
+        }
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            if (!isdigit((unsigned char)end[1])) {
+                return -1;
+            }
+            last = strtol(end + 1, &end, 10);
+        }
+        if (first > last || last >= MAX_CPUS) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (!cpu_list_has(list, (int)cpu)) {
+                list->bits[cpu / 8] |= (unsigned char)(1 << (cpu % 8));
+                list->count++;
+            }
+        }
+        p = end;
+        if (*p == ',' && p[1] != '\0') {
+            p++;
+        } else if (*p != '\0') {
+            return -1;
+        }
+    }
+    return list->count > 0 ? 0 : -1;
+}
+
+/**
+ * Print a CPU list as ranges, e.g. "0-3,8".
+ */
+void print_cpu_list(const cpu_list_t* list) {
+    const char* separator = "";
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!cpu_list_has(list, cpu)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < MAX_CPUS && cpu_list_has(list, last + 1)) {
+            last++;
+        }
+        if (last == cpu) {
+            printf("%s%d", separator, cpu);
+        } else {
+            printf("%s%d-%d", separator, cpu, last);
+        }
+        separator = ",";
+        cpu = last;
+    }
+    printf("\n");
+}
+
+/**
+ * Restrict the calling process to a set of CPUs.
+ *
+ * @param list CPUs to run on
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int set_cpu_affinity(const cpu_list_t* list) {
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (cpu_list_has(list, cpu)) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set);
+#else
+    (void)list;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Parse the CPU list of pin and check it against the CPUs the shell may
+ * run on, so that an unavailable CPU is reported once when pin runs
+ * instead of failing every command it launches. Pipelines are then only
+ * spread across CPUs that are available.
+ *
+ * @param text CPU list
+ * @param list Receives the CPUs
+ * @return 0 on success, -1 on error (already reported)
+ */
+int parse_pin_cpus(const char* text, cpu_list_t* list) {
+    if (parse_cpu_list(text, list) < 0) {
+        fprintf(stderr, "An error has occurred: Invalid CPU list\n");
+        return -1;
+    }
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return 0; /* Unknown; set_cpu_affinity will report a problem */
+    }
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu_list_has(list, cpu) && (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))) {
+            fprintf(stderr, "An error has occurred: CPU %d is not available\n", cpu);
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Parse a nice prefix the way nice(1) does: nice -n N, the legacy
+ * nice -N (meaning +N, so nice --N means -N), the shorter nice N, or
+ * plain nice for DEFAULT_NICE.
+ *
+ * @param word Words starting with "nice"
+ * @param remaining Number of words
+ * @param adjust Receives the adjustment
+ * @return Number of prefix words, 0 if no command follows them,
+ *         or -1 if the adjustment is invalid (already reported)
+ */
+int parse_nice_prefix(char** word, int remaining, long* adjust) {
+    int used;
+
+    if (strcmp(word[1], "-n") == 0) {
+        if (remaining >= 3 && parse_long(word[2], adjust) < 0) {
+            fprintf(stderr, "An error has occurred: Invalid nice adjustment\n");
+            return -1;
+        }
+        used = 3;
+    } else if (word[1][0] == '-' && word[1][1] != '\0') {
+        if (parse_long(word[1] + 1, adjust) < 0) {
+            fprintf(stderr, "An error has occurred: Invalid nice adjustment\n");
+            return -1;
+        }
+        used = 2;
+    } else if (parse_long(word[1], adjust) == 0) {
+        used = 2;
+    } else {
+        *adjust = DEFAULT_NICE;
+        used = 1;
+    }
+    return used < remaining ? used : 0;
+}
+
+/**
+ * Get the limit that launched commands will run with: the value set by
+ * ulimit, or the shell's own limit.
+ *
+ * @param index Index into limit_options
+ * @param limit Receives the limit
+ */
+void get_child_limit(int index, struct rlimit* limit) {
+    if (child_limit_set[index]) {
+        *limit = child_limits[index];
+    } else if (getrlimit(limit_options[index].resource, limit) < 0) {
+        limit->rlim_cur = RLIM_INFINITY;
+        limit->rlim_max = RLIM_INFINITY;
+    }
+}
+
+/**
+ * Print one limit in ulimit's units.
+ *
+ * @param index Index into limit_options
+ * @param hard Nonzero to print the hard limit
+ * @param label Nonzero to prefix the description (ulimit -a)
+ */
+void print_limit(int index, int hard, int label) {
+    const limit_option_t* option = &limit_options[index];
+    struct rlimit limit;
+
+    get_child_limit(index, &limit);
+    rlim_t value = hard ? limit.rlim_max : limit.rlim_cur;
+    if (label) {
+        printf("%-26s(-%c) ", option->description, option->option);
+    }
+    if (value == RLIM_INFINITY) {
+        printf("unlimited\n");
+    } else {
+        printf("%llu\n", (unsigned long long)(value / option->unit));
+    }
+}
+
+/**
+ * The ulimit built-in: ulimit [-H|-S] [-a | -c|-d|-f|-n|-s|-t|-u|-v [limit]].
+ * Limits are recorded rather than applied to the shell, and each
+ * launched command sets them with setrlimit() before exec, so lowering
+ * a hard limit never constrains the shell itself.
+ *
+ * @param argc Number of arguments
+ * @param argv Arguments, argv[0] is "ulimit"
+ * @return Exit status
+ */
+int run_ulimit(int argc, char** argv) {
+    int hard = 0, soft = 0, all = 0, which = 0;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        for (const char* flag = argv[i] + 1; *flag; flag++) {
+            int found = -1;
+            for (int j = 0; j < NUM_LIMIT_OPTIONS; j++) {
+                if (limit_options[j].option == *flag) {
+                    found = j;
+                }
+            }
+            if (*flag == 'H') {
+                hard = 1;
+            } else if (*flag == 'S') {
+                soft = 1;
+            } else if (*flag == 'a') {
+                all = 1;
+            } else if (found >= 0) {
+                which = found;
+            } else {
+                fprintf(stderr, "An error has occurred: ulimit usage: ulimit [-HS] [-a | -cdfnstuv [limit]]\n");
+                return 1;
+            }
+        }
+    }
+    if (argc - i > 1 || (all && argc - i > 0)) {
+        fprintf(stderr, "An error has occurred: ulimit usage: ulimit [-HS] [-a | -cdfnstuv [limit]]\n");
+        return 1;
+    }
+    if (all) {
+        for (int j = 0; j < NUM_LIMIT_OPTIONS; j++) {
+            print_limit(j, hard, 1);
+        }
+        return 0;
+    }
+    if (i == argc) {
+        print_limit(which, hard, 0);
+        return 0;
+    }
+
+    rlim_t unit = limit_options[which].unit;
+    rlim_t value = RLIM_INFINITY;
+    if (strcmp(argv[i], "unlimited") != 0) {
+        char* end;
+        errno = 0;
+        unsigned long long number = strtoull(argv[i], &end, 10);
+        if (!isdigit((unsigned char)argv[i][0]) || *end != '\0' || errno != 0 ||
+            number >= (RLIM_INFINITY - 1) / unit) {
+            fprintf(stderr, "An error has occurred: ulimit: invalid limit\n");
+            return 1;
+        }
+        value = (rlim_t)number * unit;
+    }
+
+    struct rlimit limit;
+    get_child_limit(which, &limit);
+    if (hard || !soft) {
+        limit.rlim_max = value;
+    }
+    if (soft || !hard) {
+        limit.rlim_cur = value;
+    }
+    if (limit.rlim_cur > limit.rlim_max) {
+        fprintf(stderr, "An error has occurred: ulimit: soft limit exceeds hard limit\n");
+        return 1;
+    }
+
+    /* Try the limit in a throwaway child, so that one the kernel refuses
+     * (such as raising a hard limit) fails here instead of in every
+     * later command */
+    int wstatus = 1 << 8;
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(setrlimit(limit_options[which].resource, &limit) < 0 ? 1 : 0);
+    }
+    while (pid > 0 && waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+    }
+    if (pid < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        fprintf(stderr, "An error has occurred: ulimit: cannot set limit\n");
+        return 1;
+    }
+    child_limits[which] = limit;
+    child_limit_set[which] = 1;
+    return 0;
+}
+
+/**
+ * Check whether a command name is a built-in.
+ *
+ * @param name Command name
+ * @return 1 if built-in, 0 otherwise
+ */
+int is_builtin(const char* name) {
+    static const char* const builtins[] = {
+        "exit", "cd", "pwd", "help", "env", "history", "alias",
+        "path", "paths", "true", "false", ":", "stats", "pin", "nice",
+        "ulimit", NULL
+    };
+    for (int i = 0; builtins[i]; i++) {
+        if (strcmp(name, builtins[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check whether a built-in only defines shell state (and prints nothing),
+ * so that its effect on startup can be replayed from a snapshot.
+ *
+ * @param argc Number of arguments
+ * @param argv Arguments, argv[0] is the built-in name
+ * @return 1 if it only defines state, 0 otherwise
+ */
+int is_state_builtin(int argc, char** argv) {
+    return (strcmp(argv[0], "alias") == 0 && argc == 3) ||
+           ((strcmp(argv[0], "path") == 0 || strcmp(argv[0], "paths") == 0) && argc > 1) ||
+           strcmp(argv[0], "true") == 0 || strcmp(argv[0], "false") == 0 ||
+           strcmp(argv[0], ":") == 0;
+}
+
+/**
+ * Run a built-in command in the current process.
+ *
+ * @param argc Number of arguments
+ * @param argv Arguments, argv[0] is the built-in name
+ * @return Exit status
+ */
+int run_builtin(int argc, char** argv) {
+    METRIC_ADD(metrics->builtins, 1);
+
+    if (strcmp(argv[0], "exit") == 0) {
+        if (argc > 2) {
+            fprintf(stderr, "An error has occurred: exit takes at most one argument\n");
+            return 1;
+        }
+        if (argc == 2) {
+            char* end;
+            long code = strtol(argv[1], &end, 10);
+            if (*argv[1] == '\0' || *end != '\0') {
+                fprintf(stderr, "An error has occurred: exit requires a numeric argument\n");
+                return STATUS_SYNTAX_ERROR;
+            }
+            shell_exit((int)(code & 0xff));
+        }
+        shell_exit(0);
+    } else if (strcmp(argv[0], "cd") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "An error has occurred: cd requires exactly one argument\n");
+            return 1;
+        }
+        if (chdir(argv[1]) < 0) {
+            fprintf(stderr, "An error has occurred: Cannot change directory\n");
+            return 1;
+        }
+        char cwd[MAX_LINE];
+        if (getcwd(cwd, sizeof(cwd)) != NULL) {
+            setenv("PWD", cwd, 1);
+        }
+    } else if (strcmp(argv[0], "pwd") == 0) {
+        if (argc != 1) {
+            fprintf(stderr, "An error has occurred: pwd takes no arguments\n");
+            return 1;
+        }
+        char cwd[MAX_LINE];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            fprintf(stderr, "An error has occurred: Cannot get current directory\n");
+            return 1;
+        }
+        printf("%s\n", cwd);
+    } else if (strcmp(argv[0], "help") == 0) {
+        if (argc != 1) {
+            fprintf(stderr, "An error has occurred: help takes no arguments\n");
+            return 1;
+        }
+        printf("cmpsh - Custom Shell Implementation\n");
+        printf("Built-in commands:\n");
+        printf("  exit [n]    - Exit the shell\n");
+        printf("  cd <dir>    - Change directory\n");
+        printf("  pwd         - Print working directory\n");
+        printf("  path <dirs> - Set executable search paths\n");
+        printf("  help        - Show this help message\n");
+        printf("  env         - Show environment variables\n");
+        printf("  history     - Show command history\n");
+        printf("  alias       - Show/set command aliases\n");
+        printf("  true, false - Return success / failure\n");
+        printf("  stats [prometheus] - Show runtime metrics\n");
+        printf("  pin <cpus> [cmd] - Pin a command, or spread pipelines, over CPUs\n");
+        printf("  nice [-n n] cmd - Run a command with lower priority\n");
+        printf("  ulimit [-HSa] [-cdfnstuv] [n] - Limit resources of commands\n");
+        printf("\nFeatures:\n");
+        printf("  - Piping: command1 | command2\n");
+        printf("  - Redirection: command > file\n");
+        printf("  - Sequencing: cmd1; cmd2, cmd1 && cmd2, cmd1 || cmd2\n");
+        printf("  - Control flow: if/then/elif/else/fi, while/until/do/done,\n");
+        printf("    for name in words; do ...; done\n");
+        printf("  - Variables: NAME=value, $NAME, ${NAME}, $? (last status)\n");
+        printf("  - Startup: search paths from $PATH, then ~/.cmpshrc\n");
+        printf("  - Signal handling: Ctrl+C, Ctrl+Z\n");
+    } else if (strcmp(argv[0], "env") == 0) {
+        if (argc != 1) {
+            fprintf(stderr, "An error has occurred: env takes no arguments\n");
+            return 1;
+        }
+        extern char **environ;
+        for (char **env = environ; *env != NULL; env++) {
+            printf("%s\n", *env);
+        }
+    } else if (strcmp(argv[0], "history") == 0) {
+        if (argc != 1) {
+            fprintf(stderr, "An error has occurred: history takes no arguments\n");
+            return 1;
+        }
+        show_history();
+    } else if (strcmp(argv[0], "alias") == 0) {
+        if (argc == 1) {
+            /* Show all aliases */
+            show_aliases();
+        } else if (argc == 3) {
+            /* Add/update alias: alias name command */
+            if (add_alias(argv[1], argv[2]) != 0) {
+                fprintf(stderr, "An error has occurred: Cannot set alias\n");
+                return 1;
+            }
+            if (!sourcing_rc) {
+                printf("Alias '%s' set to '%s'\n", argv[1], argv[2]);
+            }
+        } else {
+            fprintf(stderr, "An error has occurred: alias usage: alias [name command]\n");
+            return 1;
+        }
+    } else if (strcmp(argv[0], "path") == 0 || strcmp(argv[0], "paths") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "An error has occurred: path requires at least one argument\n");
+            return 1;
+        }
+        free_paths();
+
+        // Allocate new paths array
+        paths = malloc((argc - 1) * sizeof(char*));
+        if (paths == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1;
+        }
+
+        // Copy new paths
+        for (int i = 1; i < argc; i++) {
+            paths[num_paths] = strdup(argv[i]);
+            if (paths[num_paths] == NULL) {
+                free_paths();
+                fprintf(stderr, "Memory allocation failed\n");
+                return 1;
+            }
+            num_paths++;
+        }
+    } else if (strcmp(argv[0], "stats") == 0) {
+        if (argc == 1) {
+            show_stats();
+        } else if (argc == 2 && strcmp(argv[1], "prometheus") == 0) {
+            char text[METRICS_TEXT_SIZE];
+            format_prometheus(text, sizeof(text));
+            fputs(text, stdout);
+        } else {
+            fprintf(stderr, "An error has occurred: stats usage: stats [prometheus]\n");
+            return 1;
+        }
+    } else if (strcmp(argv[0], "pin") == 0) {
+        /* pin CPULIST command is handled as a prefix by prepare_stage */
+        if (argc == 1) {
+            if (pipeline_cpus.count > 0) {
+                print_cpu_list(&pipeline_cpus);
+            } else {
+                printf("off\n");
+            }
+        } else if (argc == 2 && strcmp(argv[1], "off") == 0) {
+            memset(&pipeline_cpus, 0, sizeof(pipeline_cpus));
+        } else if (argc == 2) {
+            cpu_list_t cpus;
+            if (parse_pin_cpus(argv[1], &cpus) < 0) {
+                return 1;
+            }
+            pipeline_cpus = cpus;
+        } else {
+            fprintf(stderr, "An error has occurred: pin usage: pin [cpus|off] [command]\n");
+            return 1;
+        }
+    } else if (strcmp(argv[0], "nice") == 0) {
+        /* nice [-n N] command is handled as a prefix by prepare_stage */
+        if (argc != 1) {
+            fprintf(stderr, "An error has occurred: nice usage: nice [-n n] command\n");
+            return 1;
+        }
+        printf("%d\n", getpriority(PRIO_PROCESS, 0));
+    } else if (strcmp(argv[0], "ulimit") == 0) {
+        return run_ulimit(argc, argv);
+    } else if (strcmp(argv[0], "false") == 0) {
+        return 1;
+    }
+    /* true and : do nothing and succeed */
+    return 0;
+}
+
+/**
+ * Find an executable in the search paths, falling back to the name itself.
+ * Lookups through absolute search paths are cached, and a cached path is
+ * re-checked with a single access() instead of scanning every directory.
+ *
+ * @param name Command name
+ * @param full_path Buffer receiving the resolved path
+ * @param size Size of full_path
+ * @return 1 if found, 0 otherwise
+ */
+int find_executable(const char* name, char* full_path, size_t size) {
+    if (name[0] == '\0') {
+        return 0; /* Would match a search directory itself */
+    }
+    const char* cached = strchr(name, '/') ? NULL : lookup_hashed_command(name);
+    if (cached) {
+        snprintf(full_path, size, "%s", cached);
+        if (access(full_path, X_OK) == 0) {
+            METRIC_ADD(metrics->path_hits, 1);
+            return 1;
+        }
+    }
+    METRIC_ADD(metrics->path_misses, 1);
+
+    for (int i = 0; i < num_paths; i++) {
+        snprintf(full_path, size, "%s/%s", paths[i], name);
+        if (access(full_path, X_OK) == 0) {
+            if (paths[i][0] == '/' && !strchr(name, '/')) {
+                hash_command(name, full_path);
+            }
+            return 1;
+        }
+    }
+    snprintf(full_path, size, "%s", name);
+    return access(full_path, X_OK) == 0;
+}
+
+/**
+ * Free the expanded words of a prepared stage.
+ */
+void free_stage(stage_t* stage) {
+    if (stage->argv) {
+        for (int i = 0; i < stage->argc; i++) {
+            free(stage->argv[i]);
+        }
+        free(stage->argv);
+    }
+    free(stage->redirect);
+    stage->argv = NULL;
+    stage->redirect = NULL;
+}
+
+/**
+ * Expand the words of a stage. Compound stages are left untouched.
+ *
+ * @param stage Stage to prepare (node must be set)
+ * @return 0 on success, -1 on failure (already reported)
+ */
+int prepare_stage(stage_t* stage) {
+    node_t* node = stage->node;
+
+    stage->argv = NULL;
+    stage->argc = 0;
+    stage->command = 0;
+    stage->redirect = NULL;
+    stage->external = 0;
+    stage->pinned = 0;
+    stage->niced = 0;
+    stage->nice_adjust = 0;
+    if (node->type != NODE_COMMAND) {
+        return 0;
+    }
+    METRIC_ADD(metrics->commands, 1);
+
+    stage->argv = malloc((node->num_words + 1) * sizeof(char*));
+    if (!stage->argv) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    for (int i = 0; i < node->num_words; i++) {
+        const word_t* word = &node->words[i];
+        stage->argv[i] = word->literal ? strdup(word->text) : expand_variables(word->text);
+        if (!stage->argv[i]) {
+            free_stage(stage);
+            return -1;
+        }
+        stage->argc++;
+    }
+    stage->argv[stage->argc] = NULL;
+
+    if (node->redirect) {
+        stage->redirect = node->redirect->literal ? strdup(node->redirect->text)
+                                                  : expand_variables(node->redirect->text);
+        if (!stage->redirect) {
+            free_stage(stage);
+            return -1;
+        }
+    }
+
+    /* Strip pin CPULIST and nice [N] prefixes off the command */
+    stage->command = node->num_assignments;
+    while (1) {
+        /* A command word that expanded to nothing is skipped */
+        while (stage->command < stage->argc && stage->argv[stage->command][0] == '\0') {
+            stage->command++;
+        }
+        if (stage->argc - stage->command < 2) {
+            break;
+        }
+        char** word = stage->argv + stage->command;
+        int remaining = stage->argc - stage->command;
+        long adjust;
+        if (strcmp(word[0], "pin") == 0 && remaining >= 3) {
+            if (parse_pin_cpus(word[1], &stage->cpus) < 0) {
+                free_stage(stage);
+                return -1;
+            }
+            stage->pinned = 1;
+            stage->command += 2;
+        } else if (strcmp(word[0], "nice") == 0) {
+            int used = parse_nice_prefix(word, remaining, &adjust);
+            if (used < 0) {
+                free_stage(stage);
+                return -1;
+            }
+            if (used == 0) {
+                break; /* No command left: the nice built-in reports usage */
+            }
+            adjust = adjust < -40 ? -40 : (adjust > 40 ? 40 : adjust);
+            stage->nice_adjust += (int)adjust;
+            stage->niced = 1;
+            stage->command += used;
+        } else {
+            break;
+        }
+    }
+
+    if (stage->command < stage->argc) {
+        stage->external = !is_builtin(stage->argv[stage->command]);
+    }
+    return 0;
+}
+
+/**
+ * Open an output redirection file.
+ *
+ * @param file File name
+ * @return File descriptor or -1 on error (already reported)
+ */
+int open_redirect(const char* file) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "An error has occurred: Cannot open output file\n");
+    }
+    return fd;
+}
+
+/**
+ * Apply CPU affinity, niceness and ulimit settings in a forked child
+ * before it runs its stage. Stages without a pin prefix take one CPU of
+ * the pipeline CPU list each, in order, so that stages joined by a pipe
+ * run on neighbouring cores; a lone command may use the whole list.
+ *
+ * @param stage Prepared stage
+ * @param index Position of the stage in its pipeline
+ * @param num_stages Number of stages in the pipeline
+ * @return 0 on success, -1 on failure (already reported)
+ */
+int apply_stage_settings(const stage_t* stage, int index, int num_stages) {
+    const cpu_list_t* cpus = NULL;
+    cpu_list_t single;
+
+    if (stage->pinned) {
+        cpus = &stage->cpus;
+    } else if (pipeline_cpus.count > 0 && num_stages == 1) {
+        cpus = &pipeline_cpus;
+    } else if (pipeline_cpus.count > 0) {
+        int skip = index % pipeline_cpus.count;
+        memset(&single, 0, sizeof(single));
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (cpu_list_has(&pipeline_cpus, cpu) && skip-- == 0) {
+                single.bits[cpu / 8] |= (unsigned char)(1 << (cpu % 8));
+                single.count = 1;
+                break;
+            }
+        }
+        cpus = &single;
+    }
+    if (cpus && set_cpu_affinity(cpus) < 0) {
+        fprintf(stderr, "An error has occurred: Cannot set CPU affinity\n");
+        return -1;
+    }
+
+    if (stage->niced) {
+        /* Like nice(1), run the command anyway if this fails */
+        errno = 0;
+        int current = getpriority(PRIO_PROCESS, 0);
+        if ((current == -1 && errno != 0) ||
+            setpriority(PRIO_PROCESS, 0, current + stage->nice_adjust) < 0) {
+            fprintf(stderr, "An error has occurred: Cannot set priority\n");
+        }
+    }
+
+    for (int i = 0; i < NUM_LIMIT_OPTIONS; i++) {
+        if (child_limit_set[i] && setrlimit(limit_options[i].resource, &child_limits[i]) < 0) {
+            fprintf(stderr, "An error has occurred: Cannot set resource limit\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Apply the NAME=value words of a command as shell variables.
+ *
+ * @param stage Prepared stage
+ * @return Exit status
+ */
+int apply_assignments(stage_t* stage) {
+    for (int i = 0; i < stage->node->num_assignments; i++) {
+        char* eq = strchr(stage->argv[i], '=');
+        *eq = '\0';
+        int rc = set_variable(stage->argv[i], eq + 1);
+        *eq = '=';
+        if (rc < 0) {
+            fprintf(stderr, "An error has occurred: Cannot set variable\n");
+            mark_rc_side_effect();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Undo export_assignments, last assignment first so that a name
+ * assigned twice gets its original value back.
+ *
+ * @param stage Prepared stage
+ * @param saved Previous values from export_assignments (freed here)
+ * @param count Number of assignments to undo
+ */
+void restore_environment(stage_t* stage, char** saved, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        char* eq = strchr(stage->argv[i], '=');
+        *eq = '\0';
+        if (saved[i]) {
+            setenv(stage->argv[i], saved[i], 1);
+            free(saved[i]);
+        } else {
+            unsetenv(stage->argv[i]);
+        }
+        *eq = '=';
+    }
+}
+
+/**
+ * Put the NAME=value words of a command into the environment, where the
+ * command sees them whether it is external or a built-in such as env.
+ *
+ * @param stage Prepared stage
+ * @param saved If not NULL, receives a copy of each name's previous value
+ *              (NULL if unset) for restore_environment
+ * @return 0 on success, -1 on error (already reported)
+ */
+int export_assignments(stage_t* stage, char** saved) {
+    for (int i = 0; i < stage->node->num_assignments; i++) {
+        char* eq = strchr(stage->argv[i], '=');
+        *eq = '\0';
+        if (saved) {
+            const char* old = getenv(stage->argv[i]);
+            saved[i] = NULL;
+            if (old && !(saved[i] = strdup(old))) {
+                *eq = '=';
+                fprintf(stderr, "Memory allocation failed\n");
+                restore_environment(stage, saved, i);
+                return -1;
+            }
+        }
+        int rc = setenv(stage->argv[i], eq + 1, 1);
+        *eq = '=';
+        if (rc < 0) {
+            fprintf(stderr, "An error has occurred: Cannot set variable\n");
+            if (saved) restore_environment(stage, saved, i + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Run a stage inside a forked child and exit with its status.
+ *
+ * @param stage Prepared stage
+ * @param fork_time When the parent called fork()
+ */
+void run_stage_in_child(stage_t* stage, const struct timespec* fork_time) {
+    if (stage->node->type != NODE_COMMAND) {
+        shell_exit(execute_node(stage->node));
+    }
+
+    if (stage->command == stage->argc) {
+        shell_exit(apply_assignments(stage));
+    }
+
+    /* Leading assignments only affect the command's environment */
+    if (export_assignments(stage, NULL) < 0) {
+        shell_exit(1);
+    }
+    if (!stage->external) {
+        shell_exit(run_builtin(stage->argc - stage->command, stage->argv + stage->command));
+    }
+    observe_histogram(&metrics->fork_exec_us, latency_bounds_us, NUM_LATENCY_BOUNDS,
+                      elapsed_us(fork_time));
+    execv(stage->full_path, stage->argv + stage->command);
+    METRIC_ADD(metrics->exec_failures, 1);
+    fprintf(stderr, "An error has occurred: Failed to execute\n");
+    shell_exit(STATUS_EXEC_FAILED);
+}
+
+/**
+ * Convert a waitpid status to a shell exit status.
+ */
+int decode_wait_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/**
+ * Fork one child per stage, connect them with pipes and wait for all.
+ * External stages must already have full_path resolved.
+ *
+ * @param stages Prepared stages
+ * @param num_stages Number of stages
+ * @return Exit status of the last stage
+ */
+int launch_stages(stage_t* stages, int num_stages) {
+    int pipe_fds[MAX_COMMANDS - 1][2];
+    pid_t pids[MAX_COMMANDS];
+    struct timespec fork_time, wait_start;
+    int num_pipes = 0;
+    int status = 0;
+
+    for (int i = 0; i < num_stages - 1; i++) {
+        if (pipe(pipe_fds[i]) < 0) {
+            fprintf(stderr, "An error has occurred: Cannot create pipe \n");
+            for (int j = 0; j < num_pipes; j++) {
+                close(pipe_fds[j][0]);
+                close(pipe_fds[j][1]);
+            }
+            return 1;
+        }
+        num_pipes++;
+    }
+
+    /* Avoid children inheriting unflushed output */
+    fflush(stdout);
+    mark_rc_side_effect();
+    observe_histogram(&metrics->pipeline_depth, depth_bounds, NUM_DEPTH_BOUNDS, num_stages);
+
+    for (int c = 0; c < num_stages; c++) {
+        clock_gettime(CLOCK_MONOTONIC, &fork_time);
+        pids[c] = fork();
+        if (pids[c] == 0) {
+            // Child process
+            in_child = 1;
+            use_child_metrics();
+            if (c > 0) {
+                dup2(pipe_fds[c-1][0], STDIN_FILENO);
+            }
+            if (c < num_stages - 1) {
+                dup2(pipe_fds[c][1], STDOUT_FILENO);
+            }
+            if (stages[c].redirect) {
+                int fd = open_redirect(stages[c].redirect);
+                if (fd < 0) {
+                    shell_exit(1);
+                }
+                dup2(fd, STDOUT_FILENO);
+                close(fd);
+            }
+
+            for (int i = 0; i < num_pipes; i++) {
+                close(pipe_fds[i][0]);
+                close(pipe_fds[i][1]);
+            }
+
+            if (apply_stage_settings(&stages[c], c, num_stages) < 0) {
+                shell_exit(1);
+            }
+            run_stage_in_child(&stages[c], &fork_time);
+        } else if (pids[c] > 0) {
+            METRIC_ADD(metrics->forks, 1);
+        } else {
+            METRIC_ADD(metrics->fork_failures, 1);
+            fprintf(stderr, "An error has occurred: Fork failed \n");
+            status = 1;
+            for (int i = c + 1; i < num_stages; i++) {
+                pids[i] = -1;
+            }
+            break;
+        }
+    }
+
+    for (int i = 0; i < num_pipes; i++) {
+        close(pipe_fds[i][0]);
+        close(pipe_fds[i][1]);
+    }
+
+    // Wait for all children
+    clock_gettime(CLOCK_MONOTONIC, &wait_start);
+    for (int c = 0; c < num_stages; c++) {
+        if (pids[c] > 0) {
+            current_child = pids[c];
+            int wstatus;
+            while (waitpid(pids[c], &wstatus, 0) < 0) {
+                if (errno != EINTR) {
+                    fprintf(stderr, "An error has occurred: Waitpid failed\n");
+                    wstatus = 1 << 8;
+                    break;
+                }
+            }
+            current_child = -1;
+            if (c == num_stages - 1 && status == 0) {
+                status = decode_wait_status(wstatus);
+            }
+        }
+    }
+    observe_histogram(&metrics->wait_us, latency_bounds_us, NUM_LATENCY_BOUNDS,
+                      elapsed_us(&wait_start));
+    return status;
+}
+
+/**
+ * Execute a simple command. Assignments and built-ins run in the
+ * shell process; external commands, and built-ins under a pin or nice
+ * prefix, are forked.
+ *
+ * @param node Command node
+ * @return Exit status
+ */
+int execute_command(node_t* node) {
+    stage_t stage;
+    int status;
+
+    stage.node = node;
+    if (prepare_stage(&stage) < 0) {
+        return 1;
+    }
+
+    if (stage.command == stage.argc) {
+        status = apply_assignments(&stage);
+    } else if (!stage.external && !stage.pinned && !stage.niced) {
+        int saved_stdout = -1;
+        char** saved_env = NULL;
+        status = 0;
+        if (node->num_assignments > 0) {
+            /* Assignments last only as long as the built-in */
+            saved_env = malloc(node->num_assignments * sizeof(char*));
+            if (!saved_env) {
+                fprintf(stderr, "Memory allocation failed\n");
+                status = 1;
+            } else if (export_assignments(&stage, saved_env) < 0) {
+                free(saved_env);
+                saved_env = NULL;
+                status = 1;
+            }
+        }
+        if (status == 0 && stage.redirect) {
+            int fd = open_redirect(stage.redirect);
+            if (fd < 0) {
+                status = 1;
+            } else {
+                fflush(stdout);
+                saved_stdout = dup(STDOUT_FILENO);
+                dup2(fd, STDOUT_FILENO);
+                close(fd);
+            }
+        }
+        if (stage.redirect || !is_state_builtin(stage.argc - stage.command,
+                                                stage.argv + stage.command)) {
+            mark_rc_side_effect();
+        }
+        if (status == 0) {
+            status = run_builtin(stage.argc - stage.command, stage.argv + stage.command);
+        }
+        if (saved_stdout >= 0) {
+            fflush(stdout);
+            dup2(saved_stdout, STDOUT_FILENO);
+            close(saved_stdout);
+        }
+        if (saved_env) {
+            restore_environment(&stage, saved_env, node->num_assignments);
+            free(saved_env);
+        }
+    } else if (stage.external && !find_executable(stage.argv[stage.command], stage.full_path,
+                                                  sizeof(stage.full_path))) {
+        fprintf(stderr, "An error has occurred: Command not found\n");
+        METRIC_ADD(metrics->not_found, 1);
+        mark_rc_side_effect();
+        status = STATUS_NOT_FOUND;
+    } else {
+        status = launch_stages(&stage, 1);
+    }
+
+    free_stage(&stage);
+    return status;
+}
+
+/**
+ * Execute a pipeline of two or more stages.
+ * Every stage runs in its own child, including built-ins and
+ * compound commands. Nothing is started if a command is missing.
+ *
+ * @param node Pipeline node
+ * @return Exit status of the last stage
+ */
+int execute_pipeline(node_t* node) {
+    stage_t stages[MAX_COMMANDS];
+    int num_stages = node->num_children;
+    int prepared = 0;
+    int status = 0;
+
+    for (int c = 0; c < num_stages; c++) {
+        stages[c].node = node->children[c];
+        if (prepare_stage(&stages[c]) < 0) {
+            status = 1;
+            break;
+        }
+        prepared++;
+        if (stages[c].external &&
+            !find_executable(stages[c].argv[stages[c].command],
+                             stages[c].full_path, sizeof(stages[c].full_path))) {
+            fprintf(stderr, "An error has occurred: Command not found\n");
+            METRIC_ADD(metrics->not_found, 1);
+            status = STATUS_NOT_FOUND;
+            break;
+        }
+    }
+
+    if (status == 0) {
+        status = launch_stages(stages, num_stages);
+    }
+
+    for (int c = 0; c < prepared; c++) {
+        free_stage(&stages[c]);
+    }
+    return status;
+}
+
+/**
+ * Execute a syntax tree node and record its status in $?.
+ *
+ * @param node Node to execute
+ * @return Exit status
+ */
+int execute_node(node_t* node) {
+    int status = 0;
+
+    switch (node->type) {
+    case NODE_COMMAND:
+        status = execute_command(node);
+        break;
+    case NODE_PIPELINE:
+        status = execute_pipeline(node);
+        break;
+    case NODE_AND:
+        status = execute_node(node->cond);
+        if (status == 0) {
+            status = execute_node(node->body);
+        }
+        break;
+    case NODE_OR:
+        status = execute_node(node->cond);
+        if (status != 0) {
+            status = execute_node(node->body);
+        }
+        break;
+    case NODE_LIST:
+        for (int i = 0; i < node->num_children && !interrupted; i++) {
+            status = execute_node(node->children[i]);
+        }
+        break;
+    case NODE_IF:
+        if (execute_node(node->cond) == 0) {
+            status = execute_node(node->body);
+        } else if (node->else_body) {
+            status = execute_node(node->else_body);
+        }
+        break;
+    case NODE_WHILE:
+        while (!interrupted && (execute_node(node->cond) == 0) != node->negate) {
+            status = execute_node(node->body);
+        }
+        break;
+    case NODE_FOR:
+        for (int i = 0; i < node->num_words && !interrupted; i++) {
+            const word_t* word = &node->words[i];
+            int num_fields = 1;
+            /* Unquoted expansions in the list give one iteration per field */
+            char* fields = word->literal ? strdup(word->text) : expand_word(word->text, &num_fields);
+            const char* field = fields;
+            int failed = !fields;
+            for (int f = 0; !failed && f < num_fields && !interrupted; f++) {
+                failed = set_variable(node->name, field) < 0;
+                if (!failed) {
+                    status = execute_node(node->body);
+                    field += strlen(field) + 1;
+                }
+            }
+            free(fields);
+            if (failed) {
+                fprintf(stderr, "An error has occurred: Cannot set variable\n");
+                status = 1;
+                break;
+            }
+        }
+        break;
+    }
+
+    last_status = status;
+    return status;
+}
+
+/**
+ * Initialize the search paths from $PATH, falling back to the common
+ * system directories when it is unset or empty. Empty entries mean the
+ * current directory.
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+int import_path(void) {
+    const char* env = getenv("PATH");
+    int count = 1;
+
+    if (!env || *env == '\0') {
+        env = "/bin:/usr/bin:/usr/local/bin";
+    }
+    for (const char* c = env; *c; c++) {
+        if (*c == ':') count++;
+    }
+
+    free_paths();
+    paths = malloc(count * sizeof(char*));
+    if (paths == NULL) {
+        return -1;
+    }
+    const char* start = env;
+    while (1) {
+        const char* end = strchr(start, ':');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        paths[num_paths] = len ? strndup(start, len) : strdup(".");
+        if (paths[num_paths] == NULL) {
+            free_paths();
+            return -1;
+        }
+        num_paths++;
+        if (!end) break;
+        start = end + 1;
+    }
+    return 0;
+}
+
+/**
+ * Append a NUL-terminated string to a snapshot buffer.
+ */
+int append_string(char** buf, size_t* len, size_t* cap, const char* str) {
+    return append_text(buf, len, cap, str, strlen(str) + 1);
+}
+
+/**
+ * Write the state defined by the rc file to a snapshot: search paths,
+ * aliases, variables and the command hash (alias commands are resolved
+ * first), keyed by the rc file's mtime and size and by the environment
+ * variables the rc read. Written to a temporary file and renamed.
+ *
+ * @param snap_path Snapshot file path
+ * @param rc_stat Status of the rc file it was compiled from
+ */
+void write_snapshot(const char* snap_path, const struct stat* rc_stat) {
+    char tmp_path[MAX_LINE + 64];
+    char full_path[MAX_LINE];
+    snapshot_header_t header;
+    char* buf = NULL;
+    size_t len = 0, cap = 0;
+    int failed = 0;
+
+    /* Pre-resolve the commands aliases run */
+    for (int i = 0; i < alias_count; i++) {
+        size_t name_len = strcspn(aliases[i].command, " \t");
+        char* name = strndup(aliases[i].command, name_len);
+        if (name && name_len > 0 && !is_builtin(name)) {
+            find_executable(name, full_path, sizeof(full_path));
+        }
+        free(name);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.rc_mtime_sec = rc_stat->st_mtim.tv_sec;
+    header.rc_mtime_nsec = rc_stat->st_mtim.tv_nsec;
+    header.rc_size = rc_stat->st_size;
+    header.num_deps = rc_env_dep_count;
+    header.num_paths = num_paths;
+    header.num_aliases = alias_count;
+    header.num_variables = variable_count;
+    header.num_hashed = hashed_count;
+    failed |= append_text(&buf, &len, &cap, (const char*)&header, sizeof(header));
+
+    /* Dependencies are stored as NAME=VALUE, or NAME if unset */
+    for (int i = 0; i < rc_env_dep_count; i++) {
+        const char* value = getenv(rc_env_deps[i]);
+        failed |= append_text(&buf, &len, &cap, rc_env_deps[i], strlen(rc_env_deps[i]));
+        if (value) {
+            failed |= append_text(&buf, &len, &cap, "=", 1);
+            failed |= append_text(&buf, &len, &cap, value, strlen(value));
+        }
+        failed |= append_text(&buf, &len, &cap, "", 1);
+    }
+    for (int i = 0; i < num_paths; i++) {
+        failed |= append_string(&buf, &len, &cap, paths[i]);
+    }
+    for (int i = 0; i < alias_count; i++) {
+        failed |= append_string(&buf, &len, &cap, aliases[i].name);
+        failed |= append_string(&buf, &len, &cap, aliases[i].command);
+    }
+    for (int i = 0; i < VARIABLE_HASH_SIZE; i++) {
+        for (variable_t* var = variables[i]; var; var = var->next) {
+            failed |= append_string(&buf, &len, &cap, var->name);
+            failed |= append_string(&buf, &len, &cap, var->value);
+        }
+    }
+    for (int i = 0; i < COMMAND_HASH_SIZE; i++) {
+        for (command_hash_entry_t* entry = command_hash[i]; entry; entry = entry->next) {
+            failed |= append_string(&buf, &len, &cap, entry->name);
+            failed |= append_string(&buf, &len, &cap, entry->path);
+        }
+    }
+    if (failed) {
+        free(buf);
+        return;
+    }
+
+    /* Snapshots are a cache: failing to write one is not an error */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", snap_path, (long)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        size_t written = 0;
+        while (written < len) {
+            ssize_t n = write(fd, buf + written, len - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            written += n;
+        }
+        close(fd);
+        if (written != len || rename(tmp_path, snap_path) < 0) {
+            unlink(tmp_path);
+        }
+    }
+    free(buf);
+}
+
+/**
+ * Return the next NUL-terminated string of a snapshot and advance.
+ *
+ * @param ptr Read position, updated
+ * @param end End of the snapshot data (which is followed by a NUL)
+ * @return String or NULL if the data is truncated
+ */
+char* next_snapshot_string(char** ptr, const char* end) {
+    char* str = *ptr;
+    if (str >= end) return NULL;
+    *ptr += strlen(str) + 1;
+    return *ptr <= end ? str : NULL;
+}
+
+/**
+ * Load shell state from a snapshot with a single read, if it is
+ * still valid for the rc file and the current environment.
+ *
+ * @param snap_path Snapshot file path
+ * @param rc_stat Status of the current rc file
+ * @return 0 if the snapshot was loaded, -1 if it is missing or stale
+ */
+int load_snapshot(const char* snap_path, const struct stat* rc_stat) {
+    snapshot_header_t header;
+    struct stat snap_stat;
+    int fd = open(snap_path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &snap_stat) < 0 || snap_stat.st_size < (off_t)sizeof(header) ||
+        snap_stat.st_size > 16 * 1024 * 1024) {
+        close(fd);
+        return -1;
+    }
+    size_t size = snap_stat.st_size;
+    char* data = malloc(size + 1);
+    if (!data) {
+        close(fd);
+        return -1;
+    }
+    ssize_t n;
+    do {
+        n = read(fd, data, size);
+    } while (n < 0 && errno == EINTR);
+    close(fd);
+    if (n != (ssize_t)size) {
+        free(data);
+        return -1;
+    }
+    data[size] = '\0';
+
+    /* Invalidate on any change to the rc file */
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.rc_mtime_sec != (long long)rc_stat->st_mtim.tv_sec ||
+        header.rc_mtime_nsec != (long long)rc_stat->st_mtim.tv_nsec ||
+        header.rc_size != (long long)rc_stat->st_size) {
+        goto invalid;
+    }
+
+    char* ptr = data + sizeof(header);
+    const char* end = data + size;
+    char* str;
+
+    /* Invalidate if an environment variable the rc read has changed */
+    for (unsigned int i = 0; i < header.num_deps; i++) {
+        if (!(str = next_snapshot_string(&ptr, end))) goto invalid;
+        char* eq = strchr(str, '=');
+        if (eq) *eq = '\0';
+        const char* value = getenv(str);
+        if (eq ? (!value || strcmp(value, eq + 1) != 0) : value != NULL) goto invalid;
+    }
+
+    /* Valid: replace the imported state */
+    free_paths();
+    paths = malloc((header.num_paths ? header.num_paths : 1) * sizeof(char*));
+    if (!paths) goto failed;
+    for (unsigned int i = 0; i < header.num_paths; i++) {
+        if (!(str = next_snapshot_string(&ptr, end)) || !(paths[num_paths] = strdup(str))) goto failed;
+        num_paths++;
+    }
+    for (unsigned int i = 0; i < header.num_aliases; i++) {
+        char* name = next_snapshot_string(&ptr, end);
+        if (!name || !(str = next_snapshot_string(&ptr, end)) || add_alias(name, str) < 0) goto failed;
+    }
+    for (unsigned int i = 0; i < header.num_variables; i++) {
+        char* name = next_snapshot_string(&ptr, end);
+        if (!name || !(str = next_snapshot_string(&ptr, end)) || set_variable(name, str) < 0) goto failed;
+    }
+    for (unsigned int i = 0; i < header.num_hashed; i++) {
+        char* name = next_snapshot_string(&ptr, end);
+        if (!name || !(str = next_snapshot_string(&ptr, end)) || hash_command(name, str) < 0) goto failed;
+    }
+    free(data);
+    return 0;
+
+failed:
+    /* Truncated after state was replaced: start again from $PATH */
+    if (import_path() < 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
+invalid:
+    free(data);
+    return -1;
+}
+
+void run_stream(FILE* stream, int interactive);
+
+/**
+ * Load ~/.cmpshrc, from its snapshot when that is still valid.
+ * Otherwise the rc is run as a script; if it only defined state
+ * (path, alias, variables), the result is saved as a new snapshot.
+ *
+ * @param stats Startup statistics to update
+ */
+void load_rc(startup_stats_t* stats) {
+    const char* home = getenv("HOME");
+    char rc_path[MAX_LINE], snap_path[MAX_LINE + sizeof(SNAPSHOT_SUFFIX)];
+    struct stat rc_stat;
+
+    if (!home) return;
+    snprintf(rc_path, sizeof(rc_path), "%s/%s", home, RC_FILE);
+    snprintf(snap_path, sizeof(snap_path), "%s%s", rc_path, SNAPSHOT_SUFFIX);
+    if (stat(rc_path, &rc_stat) < 0) return;
+
+    if (load_snapshot(snap_path, &rc_stat) == 0) {
+        stats->rc_source = "snapshot";
+        return;
+    }
+
+    FILE* rc = fopen(rc_path, "r");
+    if (!rc) return;
+    stats->rc_source = "script";
+
+    sourcing_rc = 1;
+    rc_side_effects = 0;
+    record_env_dependency("PATH"); /* Search paths start from $PATH */
+    run_stream(rc, 0);
+    fclose(rc);
+    sourcing_rc = 0;
+
+    if (!rc_side_effects) {
+        write_snapshot(snap_path, &rc_stat);
+    } else {
+        unlink(snap_path);
+    }
+    for (int i = 0; i < rc_env_dep_count; i++) {
+        free(rc_env_deps[i]);
+    }
+    rc_env_dep_count = 0;
+}
+
+/**
+ * Print startup timings for --startup-stats.
+ *
+ * @param stats Collected statistics
+ */
+void print_startup_stats(const startup_stats_t* stats) {
+    fprintf(stderr, "cmpsh startup: %ld us\n", stats->total_us);
+    fprintf(stderr, "  PATH import: %ld us (%d search paths)\n", stats->path_import_us,
+            stats->imported_paths);
+    fprintf(stderr, "  rc file:     %ld us (%s)\n", stats->rc_load_us, stats->rc_source);
+    fprintf(stderr, "  state:       %d paths, %d aliases, %d variables, %d hashed commands\n",
+            num_paths, alias_count, variable_count, hashed_count);
+}
+
+/**
+ * Read, parse and execute commands from a stream until end of input.
+ * Lines are accumulated until they form a complete command; each line
+ * is lexed once, and the tokens are parsed when no construct is open.
+ *
+ * @param stream Input stream
+ * @param interactive Nonzero to show prompts and record history
+ */
+void run_stream(FILE* stream, int interactive) {
+    char line[MAX_LINE + 1]; /* Room to put back the newline */
+    nesting_t nesting = {0, 1, 0};
+
+    while (1) {
+        /* Display prompt in interactive mode, or a continuation prompt */
+        if (interactive) {
+            printf(input_tokens.count > 0 ? "> " : "cmpsh> ");
+            fflush(stdout);
+        }
+
+        /* Read input line */
+        if (fgets(line, MAX_LINE, stream) == NULL) {
+            if (interactive) printf("\n");
+            if (input_tokens.count > 0) {
+                fprintf(stderr, "An error has occurred: Unexpected end of file\n");
+                mark_rc_side_effect();
+            }
+            break; /* EOF reached */
+        }
+
+        /* Remove newline and trim whitespace */
+        line[strcspn(line, "\n")] = 0;
+        char* trimmed_line = trim_whitespace(line);
+        if (strlen(trimmed_line) == 0 && input_tokens.count == 0) {
+            continue; /* Skip empty lines */
+        }
+
+        /* Add command to history (only in interactive mode) */
+        if (interactive) {
+            add_to_history(trimmed_line);
+        }
+
+        /* Lex only the new line, appending to the tokens read so far */
+        if (input_tokens.count > 0) {
+            input_tokens.count--; /* Drop TOK_END */
+        }
+        int first = input_tokens.count;
+        strcat(trimmed_line, "\n");
+        if (lex_input(trimmed_line, &input_tokens) < 0) {
+            /* The lexer freed the tokens */
+            nesting = (nesting_t){0, 1, 0};
+            last_status = STATUS_SYNTAX_ERROR;
+            mark_rc_side_effect();
+            continue;
+        }
+        if (!scan_nesting(&nesting, input_tokens.tokens + first, input_tokens.count - 1 - first)) {
+            continue; /* Read the rest of the construct */
+        }
+
+        node_t* program;
+        parse_status_t result = parse_tokens(&input_tokens, &program);
+        if (result == PARSE_INCOMPLETE) {
+            continue; /* Read the rest of the construct */
+        }
+        free_token_list(&input_tokens);
+        nesting = (nesting_t){0, 1, 0};
+        if (result == PARSE_ERROR) {
+            last_status = STATUS_SYNTAX_ERROR;
+            mark_rc_side_effect();
+            continue;
+        }
+
+        /* Interpret the syntax tree */
+        current_program = program;
+        interrupted = 0;
+        execute_node(program);
+        current_program = NULL;
+        free_node(program);
+    }
+
+    free_token_list(&input_tokens);
+}
+
+/**
+ * Parse and execute a complete command string (the -c option).
+ *
+ * @param command Commands to run, possibly several lines
+ * @return Exit status of the last command
+ */
+int run_string(const char* command) {
+    node_t* program;
+    parse_status_t result = parse_program(command, &program);
+
+    if (result == PARSE_INCOMPLETE) {
+        fprintf(stderr, "An error has occurred: Unexpected end of file\n");
+    }
+    if (result != PARSE_OK) {
+        return STATUS_SYNTAX_ERROR;
+    }
+
+    current_program = program;
+    interrupted = 0;
+    int status = execute_node(program);
+    current_program = NULL;
+    free_node(program);
+    return status;
+}
+
+/**
+ * Main function - Entry point for the cmpsh shell.
+ * 
+ * Usage:
+ *   ./cmpsh [options]             - Read commands from stdin; interactive
+ *                                   (prompt, history) only if it is a terminal
+ *   ./cmpsh [options] script.sh   - Non-interactive mode (execute script)
+ *   ./cmpsh [options] -c STRING   - Execute STRING and exit with its status
+ *
+ * Options:
+ *   -c STRING                Run the commands in STRING
+ *   -s                       Read commands from stdin
+ *   -i                       Interactive mode even if stdin is not a terminal
+ *   --startup-stats          Print startup timings to stderr
+ *   --norc                   Do not load ~/.cmpshrc
+ *   --metrics-file FILE      Write Prometheus metrics to FILE on SIGUSR1
+ *   --metrics-interval SECS  Also write them every SECS seconds
+ * 
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return Exit status (0 on success, 1 on error; for -c, the last command's)
+ */
+int main(int argc, char* argv[]) {
+    struct timespec start_time, phase_time;
+    startup_stats_t stats = {0, 0, 0, 0, "none"};
+    const char* command_string = NULL;
+    int read_stdin = 0;
+    int force_interactive = 0;
+    int interactive = 0;
+    int status = 0;
+    int show_startup_stats = 0;
+    int load_rc_file = 1;
+    int arg;
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    /* Parse options */
+    for (arg = 1; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg++) {
+        if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc) {
+            command_string = argv[++arg];
+        } else if (strcmp(argv[arg], "-s") == 0) {
+            read_stdin = 1;
+        } else if (strcmp(argv[arg], "-i") == 0) {
+            force_interactive = 1;
+        } else if (strcmp(argv[arg], "--startup-stats") == 0) {
+            show_startup_stats = 1;
+        } else if (strcmp(argv[arg], "--norc") == 0) {
+            load_rc_file = 0;
+        } else if (strcmp(argv[arg], "--metrics-file") == 0 && arg + 1 < argc) {
+            metrics_file = argv[++arg];
+        } else if (strcmp(argv[arg], "--metrics-interval") == 0 && arg + 1 < argc) {
+            char* end;
+            long seconds = strtol(argv[++arg], &end, 10);
+            if (*argv[arg] == '\0' || *end != '\0' || seconds < 0) {
+                fprintf(stderr, "An error has occurred: Invalid arguments\n");
+                exit(1);
+            }
+            metrics_interval = (unsigned int)seconds;
+        } else {
+            fprintf(stderr, "An error has occurred: Invalid arguments\n");
+            exit(1);
+        }
+    }
+
+    /* Determine input source based on command-line arguments */
+    if (command_string || read_stdin) {
+        if (arg != argc) {
+            fprintf(stderr, "An error has occurred: Invalid arguments\n");
+            exit(1);
+        }
+    }
+    if (command_string) {
+        /* Batch mode - commands come from -c */
+    } else if (arg == argc) {
+        /* Read from stdin; prompt and keep history only for a terminal */
+        input_stream = stdin;
+        interactive = force_interactive || isatty(STDIN_FILENO);
+    } else if (arg == argc - 1) {
+        /* Non-interactive mode - read from script file */
+        input_stream = fopen(argv[arg], "r");
+        if (input_stream == NULL) {
+            fprintf(stderr, "An error has occurred: Cannot open file\n");
+            exit(1);
+        }
+        interactive = force_interactive;
+    } else {
+        fprintf(stderr, "An error has occurred: Invalid arguments\n");
+        exit(1);
+    }
+
+    /* Generated command streams are read in large blocks */
+    if (input_stream && !interactive) {
+        setvbuf(input_stream, NULL, _IOFBF, INPUT_BUFFER_SIZE);
+    }
+
+    /* Initialize search paths from $PATH */
+    clock_gettime(CLOCK_MONOTONIC, &phase_time);
+    if (import_path() < 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    stats.path_import_us = elapsed_us(&phase_time);
+    stats.imported_paths = num_paths;
+
+    /* Set up signal handlers for proper signal propagation */
+    signal(SIGINT, sigint_handler);
+    signal(SIGTSTP, sigtstp_handler);
+
+    /* Metrics export on SIGUSR1 and every metrics_interval seconds */
+    init_metrics();
+    if (metrics_file) {
+        signal(SIGUSR1, metrics_signal_handler);
+        signal(SIGALRM, metrics_signal_handler);
+        if (metrics_interval > 0) {
+            alarm(metrics_interval);
+        }
+    }
+
+    /* Load aliases, variables and paths from ~/.cmpshrc */
+    if (load_rc_file) {
+        clock_gettime(CLOCK_MONOTONIC, &phase_time);
+        load_rc(&stats);
+        stats.rc_load_us = elapsed_us(&phase_time);
+    } else {
+        stats.rc_source = "disabled";
+    }
+    stats.total_us = elapsed_us(&start_time);
+    if (show_startup_stats) {
+        print_startup_stats(&stats);
+    }
+
+    /* Main shell loop */
+    if (command_string) {
+        status = run_string(command_string);
+    } else {
+        run_stream(input_stream, interactive);
+    }
+
+    // Cleanup
+    write_metrics_file();
+    cleanup_shell();
+    return status;
+}
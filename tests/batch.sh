@@ -0,0 +1,15 @@
+# Batch mode: -c, -s and piped stdin; any failure exits 1
+./cmpsh -c "echo one; echo two" > c.txt
+grep "^two$" c.txt > /dev/null || exit 1
+./cmpsh -c "true; false" && exit 1
+./cmpsh -c "exit 3"
+test $? = 3 || exit 1
+./cmpsh -c "if true; then" && exit 1
+echo "echo piped" | ./cmpsh > piped.txt
+grep "cmpsh>" piped.txt > /dev/null && exit 1
+grep "^piped$" piped.txt > /dev/null || exit 1
+echo history | ./cmpsh -s > history.txt
+grep "No commands in history" history.txt > /dev/null || exit 1
+echo history | ./cmpsh -i > interactive.txt
+grep "cmpsh>" interactive.txt > /dev/null || exit 1
+exit 0
@@ -0,0 +1,54 @@
+# Sequencing, exit-status operators and loops; any failure exits 1
+true; false
+if true && false; then exit 1; fi
+false || true || exit 1
+false
+test $? = 1 || exit 1
+count=
+for x in a b c; do count=$count$x; done
+if false; then exit 1; elif true; then branch=elif; else exit 1; fi
+while false; do exit 1; done
+until true; do exit 1; done
+for v in $count$branch; do
+    last=$v
+done
+echo "$last" > loop_result.txt
+cat loop_result.txt | grep abcelif > /dev/null || exit 1
+# Unquoted expansions in a for list are split into words
+list="x  y z"
+count=
+for v in $list "$list"; do count=$count.; done
+test "$count" = .... || exit 1
+# Single-quoted text is never expanded, even inside a larger word
+q=set
+echo a'$q'"$q" > quote_result.txt
+grep 'a[$]qset' quote_result.txt > /dev/null || exit 1
+echo "$q"x $q"x" > quote_result.txt
+grep "^setx setx$" quote_result.txt > /dev/null || exit 1
+# A built-in pipeline stage must not make the shell re-read its script
+printf 'true | pwd > /dev/null\necho after\n' > reread.sh
+./cmpsh reread.sh > reread.txt
+grep -c after reread.txt > count.txt
+grep "^1$" count.txt > /dev/null || exit 1
+# The variable table has no fixed size
+bash -c 'for i in $(seq 300); do echo v$i=$i; done; echo echo \$v1 \$v300' > many_vars.sh
+./cmpsh many_vars.sh > many_vars.txt
+grep "^1 300$" many_vars.txt > /dev/null || exit 1
+# Assignments before a built-in reach it, and only it
+FOO=bar env > env_result.txt
+grep "^FOO=bar$" env_result.txt > /dev/null || exit 1
+env > env_result.txt
+grep "^FOO=" env_result.txt > /dev/null && exit 1
+# A command word that expands to nothing is skipped
+e=
+$e
+test $? = 0 || exit 1
+$e true || exit 1
+# Operators in an alias value keep their meaning
+alias p "echo a | cat" > /dev/null
+p > alias_result.txt
+grep "^a$" alias_result.txt > /dev/null || exit 1
+alias nothing "" > /dev/null
+nothing || exit 1
+nothing; nothing | true || exit 1
+exit 0
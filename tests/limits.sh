@@ -0,0 +1,28 @@
+# CPU pinning, niceness and resource limits; any failure exits 1
+if test -r /proc/self/status; then
+    pin 0 grep Cpus_allowed_list /proc/self/status > cpus.txt
+    grep ":.0$" cpus.txt > /dev/null || exit 1
+    pin 0
+    true | grep Cpus_allowed_list /proc/self/status | cat > spread.txt
+    grep ":.0$" spread.txt > /dev/null || exit 1
+    pin off
+fi
+pin 1-x true && exit 1
+pin 0,1023 true && exit 1
+pin 1023 && exit 1
+nice > base.txt
+if grep "^0$" base.txt > /dev/null; then
+    nice 7 nice > nice.txt
+    grep "^7$" nice.txt > /dev/null || exit 1
+    nice -n 5 nice > nice.txt
+    grep "^5$" nice.txt > /dev/null || exit 1
+    nice -5 nice > nice.txt
+    grep "^5$" nice.txt > /dev/null || exit 1
+fi
+ulimit -n 64 || exit 1
+ulimit -n > limit.txt
+grep "^64$" limit.txt > /dev/null || exit 1
+sh -c "ulimit -n" > child_limit.txt
+grep "^64$" child_limit.txt > /dev/null || exit 1
+ulimit -q && exit 1
+exit 0
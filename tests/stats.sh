@@ -0,0 +1,12 @@
+# Runtime metrics from the stats built-in; any failure exits 1
+echo a | cat > /dev/null
+nosuchcommand
+stats > stats.txt
+stats prometheus > metrics.prom
+grep "forks:                 2 (0 failed)" stats.txt > /dev/null || exit 1
+grep "command not found:     1" stats.txt > /dev/null || exit 1
+grep "^cmpsh_forks_total 2$" metrics.prom > /dev/null || exit 1
+grep '^cmpsh_pipeline_depth_bucket{le="2"} 1$' metrics.prom > /dev/null || exit 1
+grep "^cmpsh_fork_exec_latency_seconds_count 2$" metrics.prom > /dev/null || exit 1
+stats bogus && exit 1
+exit 0